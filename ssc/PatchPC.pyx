@@ -6,9 +6,12 @@ from libc.stdint cimport uintptr_t
 cdef extern from "petsc.h" nogil:
     ctypedef long PetscInt
     ctypedef double PetscScalar
+    ctypedef double PetscReal
     ctypedef enum PetscBool:
         PETSC_TRUE, PETSC_FALSE
 
+ctypedef void (*PatchKernel)()
+
 cdef extern from "libssc.h" nogil:
     int PCPatchSetDMPlex(PETSc.PetscPC, PETSc.PetscDM)
     int PCPatchSetDefaultSF(PETSc.PetscPC, PETSc.PetscSF)
@@ -19,6 +22,9 @@ cdef extern from "libssc.h" nogil:
                                      PetscInt,
                                      const PetscInt *)
     int PCPatchSetComputeOperator(PETSc.PetscPC, int (*)(PETSc.PetscPC, PETSc.PetscMat, PetscInt, const PetscInt *, PetscInt, const PetscInt *, void *) except -1, void*)
+    int PCPatchSetComputeOperatorKernel(PETSc.PetscPC, PatchKernel, PetscInt, void **)
+    int PCPatchSetDofCoordinates(PETSc.PetscPC, PetscInt, PetscInt, const PetscReal *)
+    int PCPatchMarkDirtyCells(PETSc.PetscPC, PetscInt, const PetscInt *)
     int PCCreate_PATCH(PETSc.PetscPC)
     int PetscObjectReference(void *)
     int PCPatchInitializePackage()
@@ -100,6 +106,21 @@ cdef class PC(PETSc.PC):
                                              numBcs,
                                              <const PetscInt *>bcNodes.data) )
 
+    def setPatchDofCoordinates(self, coords):
+        """Set the coordinates of each local node (halos included),
+        for the fast diagonalisation patch solver."""
+        cdef:
+            numpy.ndarray[PetscReal, ndim=2, mode="c"] ccoords = numpy.ascontiguousarray(coords, dtype=numpy.float64)
+        CHKERR( PCPatchSetDofCoordinates(self.pc, ccoords.shape[1], ccoords.shape[0],
+                                         <const PetscReal *>ccoords.data) )
+
+    def markPatchDirtyCells(self, cells):
+        """Mark cells whose operator changed, so that the next setup
+        only rebuilds the patches containing them."""
+        cdef:
+            numpy.ndarray[PetscInt, ndim=1, mode="c"] ccells = numpy.ascontiguousarray(cells, dtype=numpy.int_)
+        CHKERR( PCPatchMarkDirtyCells(self.pc, ccells.shape[0], <const PetscInt *>ccells.data) )
+
     def setPatchComputeOperator(self, operator, args=None, kargs=None):
         if args  is None: args  = ()
         if kargs is None: kargs = {}
@@ -107,5 +128,19 @@ cdef class PC(PETSc.PC):
         self.set_attr("__compute_operator__", context)
         CHKERR( PCPatchSetComputeOperator(self.pc, PCPatch_ComputeOperator, <void *>context) )
 
+    def setPatchComputeOperatorKernel(self, kernel, args, keepalive=None):
+        """Set a compiled kernel to be called from C to build patch operators.
+
+        :arg kernel: address of the kernel.
+        :arg args: addresses of the trailing kernel arguments.
+        :arg keepalive: objects owning the data behind args, kept
+            alive as long as the PC."""
+        cdef:
+            numpy.ndarray cargs = numpy.ascontiguousarray(args, dtype=numpy.uintp)
+            PetscInt nargs = cargs.shape[0]
+        self.set_attr("__compute_operator_kernel__", keepalive)
+        CHKERR( PCPatchSetComputeOperatorKernel(self.pc, <PatchKernel><uintptr_t>kernel,
+                                                nargs, <void **>cargs.data) )
+
 
 PCPatchInitializePackage()
@@ -1,13 +1,21 @@
 #include <petsc/private/pcimpl.h>     /*I "petscpc.h" I*/
+#include <petsc/private/kspimpl.h>
 #include <petsc.h>
-#include <petsc/private/hash.h>
 #include <petscsf.h>
+#include <petscblaslapack.h>
 #include <libssc.h>
+#if defined(_OPENMP)
+#include <omp.h>
+#endif
 
-PetscLogEvent PC_Patch_CreatePatches, PC_Patch_ComputeOp, PC_Patch_Solve, PC_Patch_Scatter, PC_Patch_Apply;
+PetscLogEvent PC_Patch_CreatePatches, PC_Patch_ComputeOp, PC_Patch_Solve, PC_Patch_Scatter, PC_Patch_Apply, PC_Patch_Refactor, PC_Patch_Lag;
 
 static PetscBool PCPatchPackageInitialized = PETSC_FALSE;
 
+static const char *const PCPatchTypes[] = {"additive", "multiplicative", "symmetric", "PCPatchType", "PC_PATCH_", 0};
+static const char *const PCPatchSolverTypes[] = {"ksp", "dense", "fdm", "PCPatchSolverType", "PC_PATCH_SOLVER_", 0};
+static const char *const PCPatchPrecisions[] = {"double", "single", "PCPatchPrecision", "PC_PATCH_PRECISION_", 0};
+
 #undef __FUNCT__
 #define __FUNCT__ "PCPatchInitializePackage"
 PETSC_EXTERN PetscErrorCode PCPatchInitializePackage(void)
@@ -23,6 +31,8 @@ PETSC_EXTERN PetscErrorCode PCPatchInitializePackage(void)
     ierr = PetscLogEventRegister("PCPATCHSolve", PC_CLASSID, &PC_Patch_Solve); CHKERRQ(ierr);
     ierr = PetscLogEventRegister("PCPATCHApply", PC_CLASSID, &PC_Patch_Apply); CHKERRQ(ierr);
     ierr = PetscLogEventRegister("PCPATCHScatter", PC_CLASSID, &PC_Patch_Scatter); CHKERRQ(ierr);
+    ierr = PetscLogEventRegister("PCPATCHRefactor", PC_CLASSID, &PC_Patch_Refactor); CHKERRQ(ierr);
+    ierr = PetscLogEventRegister("PCPATCHLag", PC_CLASSID, &PC_Patch_Lag); CHKERRQ(ierr);
 
     PetscFunctionReturn(0);
 }
@@ -55,16 +65,129 @@ typedef struct {
     PetscInt        nodesPerCell;
     const PetscInt *cellNodeMap; /* Map from cells to nodes */
 
+    PCPatchSolverType solver_type; /* KSP per patch, or dense LU factors? */
+    PetscInt        dense_max_size; /* Largest patch (in dofs) to factor densely */
+    PetscInt64     *denseOffsets; /* Offset of each patch's factors
+                                   * (-1 if patch uses a KSP) */
+    PetscScalar    *denseFactors; /* LU factors of dense patches, contiguous */
+    PetscInt64      denseFactorSize;
+    PCPatchPrecision precision; /* Precision dense factors are kept in */
+    float          *denseFactorsSingle; /* Replaces denseFactors if
+                                         * single */
+    PetscScalar    *denseScratch; /* One patch, factored in double before
+                                   * rounding into denseFactorsSingle */
+    PetscInt        denseMaxDof; /* Largest dense patch, in scalar dofs */
+    PetscBLASInt   *densePivots; /* Pivots, offset by gtolCounts */
+    PetscBool       share_factors; /* Share factors of equivalent patches? */
+    PetscInt       *denseShared; /* Patch whose factors (and pivots) each
+                                  * dense patch uses */
+    PetscInt       *densePerms; /* Canonical ordering of each patch's dofs,
+                                 * offset by gtolCounts */
+    PetscInt        nuniqueFactors;
+    PetscInt        coordDim;
+    PetscReal      *dofCoords;  /* Coordinates of each local node */
+    PetscInt       *fdmDims;    /* Tensor grid of each patch's interior
+                                 * dofs, nx and ny (0 if not a grid) */
+    PetscInt       *fdmIdx;     /* Patch dof at each grid point, offset
+                                 * by gtolCounts */
+    PetscInt64     *fdmOffsets; /* Offset of each patch's fast
+                                 * diagonalisation (-1 if uses a KSP) */
+    PetscScalar    *fdmData;    /* Eigenvectors V, W and eigenvalues of
+                                 * each patch, contiguous */
+    PetscScalar    *fdmWork;
+    PetscInt        nfdm;
     KSP            *ksp;        /* Solvers for each patch */
+    PetscInt        nthreads;   /* Threads for patch application */
+    PetscSection    colourCounts; /* Number of patches of each colour */
+    IS              colourPatches; /* Patches of each colour, no two
+                                    * in a colour share a dof */
     Vec             localX, localY;
-    Vec             dof_weights; /* In how many patches does each dof lie? */
-    Vec            *patchX, *patchY; /* Work vectors for patches */
+    Vec             dof_weights; /* One over the number of patches each
+                                  * global dof lies in */
+    PetscBool       restricted; /* Take each dof's correction from one patch? */
+    PetscScalar    *patchXArray, *patchYArray; /* Work space for all
+                                                * patches, offset by
+                                                * gtolCounts */
+    Vec            *patchX, *patchY; /* Vecs wrapping the work space,
+                                      * only where PETSc needs them */
+    PetscInt       *gatherIdx;  /* Entry of the local vectors for each
+                                 * patch entry, -(idx+1) for patch BCs */
+    PetscBool      *interior;   /* Does the patch only touch owned dofs? */
+    PetscInt        ninterior;
+    PetscBool      *truncated;  /* Is each patch cut short by the partition?
+                                 * (only during setup) */
+    PetscInt        ntruncated; /* Patches cut short by the partition (over
+                                 * all processes) */
+    PetscReal      *patchCost;  /* Estimated work to factor each patch */
+    PetscReal       costLocal, costMin, costMax, costMean; /* Estimated work
+                                                            * of this process,
+                                                            * and over processes */
+    PetscInt       *ownedIdx;   /* As gatherIdx, but into the owned part of
+                                 * the global vectors (interior patches) */
+    PetscInt       *scatterIdx; /* As gatherIdx, with entries the patch
+                                 * doesn't own also negative (restricted) */
+    PetscInt       *ownedScatterIdx; /* Likewise for ownedIdx */
     Mat            *mat;        /* Operators */
+    Mat            *matWithBcs; /* Operators without patch BCs applied
+                                 * (multiplicative residual updates) */
+    PCPatchType     type;       /* How to combine the patch corrections */
     MatType         sub_mat_type;
     PetscErrorCode (*usercomputeop)(PC, Mat, PetscInt, const PetscInt *, PetscInt, const PetscInt *, void *);
     void           *usercomputectx;
+    void          (*kernel)(void); /* Compiled assembly kernel, called directly */
+    PetscInt        nkernelargs;
+    void          **kernelargs; /* Trailing (data, map) arguments of the kernel */
+    PetscBool       cache_element_matrices; /* Compute each cell's element matrix once? */
+    PetscInt        nelementSlots;
+    PetscInt       *elementSlots; /* Slot of each cell in elementMats (or -1) */
+    PetscInt       *elementCells; /* Cell in each slot */
+    PetscScalar    *elementMats; /* Element matrices, row major */
+    PetscBool       matrix_free; /* Apply KSP patch operators matrix-free
+                                  * (from elementMats)? */
+    PetscBool       condense;   /* Eliminate cell interior dofs before
+                                 * patch solves? */
+    PetscBool      *cellInterior; /* Is each node of a cell interior to it? */
+    PetscInt        ncellInterior;
+    PetscInt       *condenseIdx; /* Cell local entries, interior ones first */
+    PetscScalar    *condenseData; /* K_ii^-1, K_ii^-1 K_ib and K_bi K_ii^-1
+                                   * of each cached cell, column major */
+    PetscScalar    *condenseWork;
+    PetscBool       detect_changes; /* Compare element matrices to find
+                                     * the patches to rebuild? */
+    PetscBool       dirtyMarked; /* Marked since the last PCSetUp? */
+    PetscInt        ndirtyCells;
+    PetscInt       *dirtyCells; /* Cells (Firedrake numbering) marked
+                                 * since the last PCSetUp */
+    PetscInt        ncellNumbers;
+    PetscBool      *cellDirty;  /* Has each cell changed? */
+    PetscBool      *patchDirty; /* Is each patch rebuilt at this PCSetUp? */
+    PetscInt        nrebuilt;
+    PetscInt        refactor_every; /* Rebuild the patch operators and
+                                     * factors every this many PCSetUps */
+    PetscInt        nlagged;    /* PCSetUps since the last rebuild */
+    PetscInt        nrefactor;  /* Rebuilds so far */
+    PetscReal       cache_mb;   /* Memory for KSP patch operators and
+                                 * factors kept between PCApplys when
+                                 * operators aren't saved */
+    PetscBool      *lruCached;  /* Is the patch's KSP set up and kept? */
+    PetscInt       *lruPrev, *lruNext; /* Kept patches, most recently used
+                                        * first, -1 terminated */
+    PetscInt        lruHead, lruTail;
+    PetscLogDouble *lruBytes;   /* Estimated memory of each kept patch */
+    PetscLogDouble  lruTotal;
+    PetscInt        ncached, lruHits, lruMisses;
+    PetscInt       *nnz;        /* Nonzero blocks in each block row of
+                                 * the patch operators, offset by
+                                 * gtolCounts */
+    PetscInt       *nnzUpper;   /* As nnz, on and above the diagonal */
+    PetscInt       *patchVertices; /* Vertex each patch is the star of */
+    PetscBool       reorder;    /* Order patches and their dofs by RCM? */
+    PetscInt       *patchOrder; /* Order to apply the patches in (or NULL) */
 } PC_PATCH;
 
+/* Most trailing arguments a compiled kernel can take. */
+#define PC_PATCH_MAX_KERNEL_ARGS 16
+
 #undef __FUNCT__
 #define __FUNCT__ "PCPatchSetDMPlex"
 PETSC_EXTERN PetscErrorCode PCPatchSetDMPlex(PC pc, DM dm)
@@ -100,6 +223,28 @@ PETSC_EXTERN PetscErrorCode PCPatchSetPartitionOfUnity(PC pc, PetscBool flg)
     PetscFunctionReturn(0);
 }
 
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetRestricted"
+PETSC_EXTERN PetscErrorCode PCPatchSetRestricted(PC pc, PetscBool flg)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    patch->restricted = flg;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetCacheElementMatrices"
+PETSC_EXTERN PetscErrorCode PCPatchSetCacheElementMatrices(PC pc, PetscBool flg)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    patch->cache_element_matrices = flg;
+    PetscFunctionReturn(0);
+}
+
 #undef __FUNCT__
 #define __FUNCT__ "PCPatchSetDefaultSF"
 PETSC_EXTERN PetscErrorCode PCPatchSetDefaultSF(PC pc, PetscSF sf)
@@ -164,6 +309,206 @@ PETSC_EXTERN PetscErrorCode PCPatchSetSubMatType(PC pc, MatType sub_mat_type)
     PetscFunctionReturn(0);
 }
 
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetType"
+PETSC_EXTERN PetscErrorCode PCPatchSetType(PC pc, PCPatchType type)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    patch->type = type;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetSolverType"
+PETSC_EXTERN PetscErrorCode PCPatchSetSolverType(PC pc, PCPatchSolverType type)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    patch->solver_type = type;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetDenseMaxSize"
+PETSC_EXTERN PetscErrorCode PCPatchSetDenseMaxSize(PC pc, PetscInt size)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    patch->dense_max_size = size;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetPrecision"
+PETSC_EXTERN PetscErrorCode PCPatchSetPrecision(PC pc, PCPatchPrecision precision)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+#if defined(PETSC_USE_COMPLEX)
+    if (precision == PC_PATCH_PRECISION_SINGLE) {
+        SETERRQ(PetscObjectComm((PetscObject)pc), PETSC_ERR_SUP, "Single precision patch factors need real scalars\n");
+    }
+#endif
+    patch->precision = precision;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetMatrixFree"
+PETSC_EXTERN PetscErrorCode PCPatchSetMatrixFree(PC pc, PetscBool flg)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    patch->matrix_free = flg;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetCondense"
+PETSC_EXTERN PetscErrorCode PCPatchSetCondense(PC pc, PetscBool flg)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    patch->condense = flg;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetCacheMB"
+PETSC_EXTERN PetscErrorCode PCPatchSetCacheMB(PC pc, PetscReal mb)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    patch->cache_mb = mb;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetReorder"
+PETSC_EXTERN PetscErrorCode PCPatchSetReorder(PC pc, PetscBool flg)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    patch->reorder = flg;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetRefactorEvery"
+PETSC_EXTERN PetscErrorCode PCPatchSetRefactorEvery(PC pc, PetscInt k)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    if (k < 1) {
+        SETERRQ1(PetscObjectComm((PetscObject)pc), PETSC_ERR_ARG_OUTOFRANGE, "Must refactor at least every PCSetUp, not every %D\n", k);
+    }
+    patch->refactor_every = k;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetDetectChanges"
+PETSC_EXTERN PetscErrorCode PCPatchSetDetectChanges(PC pc, PetscBool flg)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    patch->detect_changes = flg;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchMarkDirtyCells"
+/*
+ * PCPatchMarkDirtyCells - Say which cells' operators have changed since
+ * the last PCSetUp, so that the next one only rebuilds the patches
+ * containing them.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . n - Number of cells
+ * - cells - The cells (Firedrake numbering)
+ *
+ * Note:
+ *  Marks accumulate until the next PCSetUp.  Once anything is marked
+ *  (even no cells), unmarked cells are taken as unchanged; otherwise
+ *  every patch is rebuilt.
+ */
+PETSC_EXTERN PetscErrorCode PCPatchMarkDirtyCells(PC pc, PetscInt n, const PetscInt *cells)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    ierr = PetscRealloc(sizeof(PetscInt)*(patch->ndirtyCells + n), &patch->dirtyCells); CHKERRQ(ierr);
+    ierr = PetscMemcpy(patch->dirtyCells + patch->ndirtyCells, cells, n*sizeof(PetscInt)); CHKERRQ(ierr);
+    patch->ndirtyCells += n;
+    patch->dirtyMarked  = PETSC_TRUE;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetDofCoordinates"
+/*
+ * PCPatchSetDofCoordinates - Give the coordinates of each local node,
+ * used to find tensor product patches for fast diagonalisation.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . dim - Geometric dimension
+ * . n - Number of local nodes
+ * - coords - Coordinates, n*dim (copied)
+ */
+PETSC_EXTERN PetscErrorCode PCPatchSetDofCoordinates(PC pc, PetscInt dim, PetscInt n, const PetscReal *coords)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    ierr = PetscFree(patch->dofCoords); CHKERRQ(ierr);
+    ierr = PetscMalloc1(n*dim, &patch->dofCoords); CHKERRQ(ierr);
+    ierr = PetscMemcpy(patch->dofCoords, coords, n*dim*sizeof(PetscReal)); CHKERRQ(ierr);
+    patch->coordDim = dim;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetShareFactors"
+PETSC_EXTERN PetscErrorCode PCPatchSetShareFactors(PC pc, PetscBool flg)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+    patch->share_factors = flg;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetNumThreads"
+PETSC_EXTERN PetscErrorCode PCPatchSetNumThreads(PC pc, PetscInt nthreads)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscFunctionBegin;
+
+#if !defined(_OPENMP)
+    if (nthreads > 1) {
+        SETERRQ(PetscObjectComm((PetscObject)pc), PETSC_ERR_SUP, "libssc was built without OpenMP, rebuild with make OPENMP=1\n");
+    }
+#endif
+    patch->nthreads = nthreads;
+    PetscFunctionReturn(0);
+}
+
 #undef __FUNCT__
 #define __FUNCT__ "PCPatchSetComputeOperator"
 PETSC_EXTERN PetscErrorCode PCPatchSetComputeOperator(PC pc, PetscErrorCode (*func)(PC, Mat, PetscInt,
@@ -183,6 +528,115 @@ PETSC_EXTERN PetscErrorCode PCPatchSetComputeOperator(PC pc, PetscErrorCode (*fu
     PetscFunctionReturn(0);
 }
 
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetComputeOperatorKernel"
+/*
+ * PCPatchSetComputeOperatorKernel - Set a compiled assembly kernel to be
+ * called directly from C to build patch operators.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . kernel - The kernel, with signature
+ *            kernel(int start, int end, const PetscInt *cells, Mat mat,
+ *                   const PetscInt *rowmap, const PetscInt *colmap,
+ *                   void *arg0, ...)
+ * . nargs - Number of trailing (pointer) arguments
+ * - args - The trailing arguments (copied)
+ *
+ * Note:
+ *  This takes precedence over PCPatchSetComputeOperator().  The data
+ *  behind the arguments must stay alive as long as the PC.  The
+ *  matrix is assembled after the kernel has been called.
+ */
+PETSC_EXTERN PetscErrorCode PCPatchSetComputeOperatorKernel(PC pc, void (*kernel)(void), PetscInt nargs, void **args)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+
+    PetscFunctionBegin;
+    if (nargs < 0 || nargs > PC_PATCH_MAX_KERNEL_ARGS) {
+        SETERRQ2(PetscObjectComm((PetscObject)pc), PETSC_ERR_ARG_OUTOFRANGE, "Kernel takes %D arguments, at most %D supported\n",
+                 nargs, (PetscInt)PC_PATCH_MAX_KERNEL_ARGS);
+    }
+    ierr = PetscFree(patch->kernelargs); CHKERRQ(ierr);
+    ierr = PetscMalloc1(nargs, &patch->kernelargs); CHKERRQ(ierr);
+    ierr = PetscMemcpy(patch->kernelargs, args, nargs*sizeof(void *)); CHKERRQ(ierr);
+    patch->kernel = kernel;
+    patch->nkernelargs = nargs;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchGetClosurePoints_Private"
+/*
+ * PCPatchGetClosurePoints_Private - Collect the points in the
+ * (downward) closure of a point by walking the cones.
+ *
+ * Input Parameters:
+ * + dm - The DMPlex
+ * . p - The point
+ * - maxPoints - Size of points
+ *
+ * Output Parameters:
+ * + npoints - Number of points in the closure
+ * - points - The points, p first, then by decreasing depth
+ *
+ * Note:
+ *  Unlike DMPlexGetTransitiveClosure this carries no orientations
+ *  and touches no work arrays from the DM, so it is cheap enough to
+ *  call once per cell and facet during setup.
+ */
+static PetscErrorCode PCPatchGetClosurePoints_Private(DM dm, PetscInt p, PetscInt maxPoints, PetscInt *npoints, PetscInt *points)
+{
+    PetscErrorCode ierr;
+    PetscInt       n = 1, start = 0;
+
+    PetscFunctionBegin;
+    points[0] = p;
+    /* Points of one depth are [start, end), their cones go after. */
+    while (start < n) {
+        const PetscInt end = n;
+        for ( PetscInt i = start; i < end; i++ ) {
+            const PetscInt *cone;
+            PetscInt        coneSize;
+            ierr = DMPlexGetConeSize(dm, points[i], &coneSize); CHKERRQ(ierr);
+            ierr = DMPlexGetCone(dm, points[i], &cone); CHKERRQ(ierr);
+            for ( PetscInt j = 0; j < coneSize; j++ ) {
+                PetscBool seen = PETSC_FALSE;
+                /* Closures are small, a linear search is fine. */
+                for ( PetscInt k = end; k < n && !seen; k++ ) seen = (PetscBool)(points[k] == cone[j]);
+                if (seen) continue;
+                if (n >= maxPoints) {
+                    SETERRQ1(PETSC_COMM_SELF, PETSC_ERR_PLIB, "Closure of point %D larger than expected\n", p);
+                }
+                points[n++] = cone[j];
+            }
+        }
+        start = end;
+    }
+    *npoints = n;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchGetMaxClosureSize_Private"
+/* Bound on the number of points in the closure of any point. */
+static PetscErrorCode PCPatchGetMaxClosureSize_Private(DM dm, PetscInt *maxPoints)
+{
+    PetscErrorCode ierr;
+    PetscInt       depth, maxCone, size = 1, level = 1;
+
+    PetscFunctionBegin;
+    ierr = DMPlexGetDepth(dm, &depth); CHKERRQ(ierr);
+    ierr = DMPlexGetMaxSizes(dm, &maxCone, NULL); CHKERRQ(ierr);
+    for ( PetscInt d = 0; d < depth; d++ ) {
+        level *= maxCone;
+        size  += level;
+    }
+    *maxPoints = size;
+    PetscFunctionReturn(0);
+}
+
 #undef __FUNCT__
 #define __FUNCT__ "PCPatchCreateCellPatches"
 /*
@@ -192,8 +646,17 @@ PETSC_EXTERN PetscErrorCode PCPatchSetComputeOperator(PC pc, PetscErrorCode (*fu
  * + dm - The DMPlex object defining the mesh
  *
  * Output Parameters:
- * + cellCounts - Section with counts of cells around each vertex
- * - cells - IS of the cell point indices of cells in each patch
+ * + cellCounts - Section with counts of cells in each patch
+ * . cells - IS of the cell point indices of cells in each patch
+ * - patchVertices - The vertex of each patch
+ *
+ * Note:
+ *  Rather than computing the star of every vertex, we invert the
+ *  cell to vertex map.  A single pass over the cells records each
+ *  cell's vertices and counts the cells around each owned vertex;
+ *  the fill then only reads back those vertex lists.  Cells in each
+ *  patch come out in increasing order.  Only owned vertices with
+ *  cells around them get a patch, numbered from zero in vertex order.
  */
 static PetscErrorCode PCPatchCreateCellPatches(PC pc)
 {
@@ -203,10 +666,15 @@ static PetscErrorCode PCPatchCreateCellPatches(PC pc)
     DMLabel         ghost;
     PetscInt        pStart, pEnd, vStart, vEnd, cStart, cEnd;
     PetscBool       flg;
-    PetscInt        closureSize;
-    PetscInt       *closure    = NULL;
+    PetscInt        maxPoints, npoints;
+    PetscInt       *points     = NULL;
+    PetscBool      *owned      = NULL;
+    PetscInt       *counts     = NULL;
+    PetscInt       *cellVertOffsets = NULL;
+    PetscInt       *cellVerts  = NULL;
+    PetscInt        nCellVerts, maxCellVerts;
     PetscInt       *cellsArray = NULL;
-    PetscInt        numCells;
+    PetscInt        numCells, npatch;
     PetscSection    cellCounts;
 
     PetscFunctionBegin;
@@ -224,58 +692,77 @@ static PetscErrorCode PCPatchCreateCellPatches(PC pc)
     ierr = DMGetLabel(dm, "pyop2_ghost", &ghost); CHKERRQ(ierr);
 
     ierr = DMLabelCreateIndex(ghost, pStart, pEnd); CHKERRQ(ierr);
-
-    ierr = PetscSectionCreate(PETSC_COMM_SELF, &patch->cellCounts); CHKERRQ(ierr);
-    cellCounts = patch->cellCounts;
-    ierr = PetscSectionSetChart(cellCounts, vStart, vEnd); CHKERRQ(ierr);
-
-    /* Count cells surrounding each vertex */
+    ierr = PetscMalloc2(vEnd - vStart, &owned, vEnd - vStart, &counts); CHKERRQ(ierr);
     for ( PetscInt v = vStart; v < vEnd; v++ ) {
         ierr = DMLabelHasPoint(ghost, v, &flg); CHKERRQ(ierr);
-        /* Not an owned vertex, don't make a cell patch. */
-        if (flg) {
-            continue;
-        }
-        ierr = DMPlexGetTransitiveClosure(dm, v, PETSC_FALSE, &closureSize, &closure); CHKERRQ(ierr);
-        for ( PetscInt ci = 0; ci < closureSize; ci++ ) {
-            const PetscInt c = closure[2*ci];
-            if (cStart <= c && c < cEnd) {
-                ierr = PetscSectionAddDof(cellCounts, v, 1); CHKERRQ(ierr);
+        owned[v - vStart] = flg ? PETSC_FALSE : PETSC_TRUE;
+        counts[v - vStart] = 0;
+    }
+    ierr = DMLabelDestroyIndex(ghost); CHKERRQ(ierr);
+
+    ierr = PCPatchGetMaxClosureSize_Private(dm, &maxPoints); CHKERRQ(ierr);
+    ierr = PetscMalloc1(maxPoints, &points); CHKERRQ(ierr);
+
+    /* Record the owned vertices of each cell and count the cells
+     * surrounding each vertex in the same pass. */
+    maxCellVerts = 4*(cEnd - cStart);
+    ierr = PetscMalloc1(cEnd - cStart + 1, &cellVertOffsets); CHKERRQ(ierr);
+    ierr = PetscMalloc1(maxCellVerts, &cellVerts); CHKERRQ(ierr);
+    nCellVerts = 0;
+    for ( PetscInt c = cStart; c < cEnd; c++ ) {
+        cellVertOffsets[c - cStart] = nCellVerts;
+        ierr = PCPatchGetClosurePoints_Private(dm, c, maxPoints, &npoints, points); CHKERRQ(ierr);
+        for ( PetscInt i = 0; i < npoints; i++ ) {
+            const PetscInt v = points[i];
+            /* Not an owned vertex, don't make a cell patch. */
+            if (v < vStart || v >= vEnd || !owned[v - vStart]) continue;
+            if (nCellVerts >= maxCellVerts) {
+                maxCellVerts = (PetscInt)((1 + maxCellVerts)*1.5);
+                ierr = PetscRealloc(sizeof(PetscInt)*maxCellVerts, &cellVerts); CHKERRQ(ierr);
             }
+            cellVerts[nCellVerts++] = v;
+            counts[v - vStart]++;
         }
     }
-    ierr = DMLabelDestroyIndex(ghost); CHKERRQ(ierr);
+    cellVertOffsets[cEnd - cStart] = nCellVerts;
+    ierr = PetscFree(points); CHKERRQ(ierr);
 
+    /* Ghost vertices, and any without cells, get no patch. */
+    npatch = 0;
+    for ( PetscInt v = vStart; v < vEnd; v++ ) {
+        if (counts[v - vStart] > 0) npatch++;
+    }
+    ierr = PetscMalloc1(npatch, &patch->patchVertices); CHKERRQ(ierr);
+    ierr = PetscSectionCreate(PETSC_COMM_SELF, &patch->cellCounts); CHKERRQ(ierr);
+    cellCounts = patch->cellCounts;
+    ierr = PetscSectionSetChart(cellCounts, 0, npatch); CHKERRQ(ierr);
+    npatch = 0;
+    for ( PetscInt v = vStart; v < vEnd; v++ ) {
+        if (counts[v - vStart] <= 0) continue;
+        patch->patchVertices[npatch] = v;
+        ierr = PetscSectionSetDof(cellCounts, npatch++, counts[v - vStart]); CHKERRQ(ierr);
+    }
     ierr = PetscSectionSetUp(cellCounts); CHKERRQ(ierr);
     ierr = PetscSectionGetStorageSize(cellCounts, &numCells); CHKERRQ(ierr);
     ierr = PetscMalloc1(numCells, &cellsArray); CHKERRQ(ierr);
 
-    /* Now that we know how much space we need, run through again and
-     * actually remember the cells. */
-    for ( PetscInt v = vStart; v < vEnd; v++ ) {
-        PetscInt ndof, off;
-        ierr = PetscSectionGetDof(cellCounts, v, &ndof); CHKERRQ(ierr);
-        ierr = PetscSectionGetOffset(cellCounts, v, &off); CHKERRQ(ierr);
-        if ( ndof <= 0 ) {
-            continue;
-        }
-        ierr = DMPlexGetTransitiveClosure(dm, v, PETSC_FALSE, &closureSize, &closure); CHKERRQ(ierr);
-        ndof = 0;
-        for ( PetscInt ci = 0; ci < closureSize; ci++ ) {
-            const PetscInt c = closure[2*ci];
-            if (cStart <= c && c < cEnd) {
-                cellsArray[ndof + off] = c;
-                ndof++;
-            }
-        }
+    /* Now that we know how much space we need, fill in the cells,
+     * reusing counts as the insertion point of each vertex. */
+    for ( PetscInt p = 0; p < npatch; p++ ) {
+        const PetscInt v = patch->patchVertices[p];
+        ierr = PetscSectionGetOffset(cellCounts, p, &counts[v - vStart]); CHKERRQ(ierr);
     }
-    if (closure) {
-        ierr = DMPlexRestoreTransitiveClosure(dm, 0, PETSC_FALSE, &closureSize, &closure); CHKERRQ(ierr);
+    for ( PetscInt c = cStart; c < cEnd; c++ ) {
+        for ( PetscInt i = cellVertOffsets[c - cStart]; i < cellVertOffsets[c - cStart + 1]; i++ ) {
+            cellsArray[counts[cellVerts[i] - vStart]++] = c;
+        }
     }
+    ierr = PetscFree(cellVerts); CHKERRQ(ierr);
+    ierr = PetscFree(cellVertOffsets); CHKERRQ(ierr);
+    ierr = PetscFree2(owned, counts); CHKERRQ(ierr);
 
     ierr = ISCreateGeneral(PETSC_COMM_SELF, numCells, cellsArray, PETSC_OWN_POINTER, &patch->cells); CHKERRQ(ierr);
-    ierr = PetscSectionGetChart(patch->cellCounts, &pStart, &pEnd); CHKERRQ(ierr);
-    patch->npatch = pEnd - pStart;
+    patch->npatch = npatch;
     PetscFunctionReturn(0);
 }
 
@@ -286,7 +773,7 @@ static PetscErrorCode PCPatchCreateCellPatches(PC pc)
  *
  * Input Parameters:
  * + dm - The DMPlex object defining the mesh
- * . cellCounts - Section with counts of cells around each vertex
+ * . cellCounts - Section with counts of cells in each patch
  * - cells - IS of the cell point indices of cells in each patch
  *
  * Output Parameters:
@@ -295,7 +782,12 @@ static PetscErrorCode PCPatchCreateCellPatches(PC pc)
  *
  * Note:
  *  The output facets do not include those facets that are the
- *  boundary of the domain, they are treated separately.
+ *  boundary of the domain, they are treated separately.  A facet
+ *  through the patch vertex with only one cell that isn't on the domain
+ *  boundary is on the edge of the local mesh, so the star is truncated
+ *  there: the mesh needs a vertex overlap for full patches.  Such
+ *  patches are flagged in truncated.  (Far facets of the star may lie
+ *  on the edge of the overlap, which is fine.)
  */
 static PetscErrorCode PCPatchCreateCellPatchFacets(PC pc, PetscSection *facetCounts, IS *facets)
 {
@@ -312,7 +804,10 @@ static PetscErrorCode PCPatchCreateCellPatchFacets(PC pc, PetscSection *facetCou
     const PetscInt *facetCells  = NULL;
     PetscInt       *facetsArray = NULL;
     const PetscInt *cellsArray  = NULL;
-    PetscHashI      ht;
+    PetscInt        cStart, cEnd;
+    PetscInt       *inPatch     = NULL;
+    PetscInt       *points      = NULL;
+    PetscInt        maxPoints, npoints;
 
     PetscFunctionBegin;
 
@@ -320,7 +815,8 @@ static PetscErrorCode PCPatchCreateCellPatchFacets(PC pc, PetscSection *facetCou
      * treat here. */
     ierr = DMGetLabel(dm, "exterior_facets", &facetLabel); CHKERRQ(ierr);
 
-    ierr = DMPlexGetDepthStratum(dm, 0, &vStart, &vEnd); CHKERRQ(ierr);
+    /* Patches, not vertices. */
+    ierr = PetscSectionGetChart(cellCounts, &vStart, &vEnd); CHKERRQ(ierr);
     ierr = DMPlexGetHeightStratum(dm, 1, &fStart, &fEnd); CHKERRQ(ierr);
     ierr = DMLabelCreateIndex(facetLabel, fStart, fEnd); CHKERRQ(ierr);
 
@@ -333,8 +829,11 @@ static PetscErrorCode PCPatchCreateCellPatchFacets(PC pc, PetscSection *facetCou
      * boundary.  The exception is for facets that are exterior to
      * the whole domain (where the normal bcs are applied). */
 
-    /* Used to keep track of the cells in the patch. */
-    PetscHashICreate(ht);
+    /* Used to keep track of the cells in the patch: a cell is in
+     * the current patch iff it is stamped with the patch. */
+    ierr = DMPlexGetHeightStratum(dm, 0, &cStart, &cEnd); CHKERRQ(ierr);
+    ierr = PetscMalloc1(cEnd - cStart, &inPatch); CHKERRQ(ierr);
+    for ( PetscInt c = 0; c < cEnd - cStart; c++ ) inPatch[c] = -1;
 
     /* Guess at number of facets: each cell contributes one facet to
      * the boundary facets.  Hopefully we will only realloc a little
@@ -344,18 +843,16 @@ static PetscErrorCode PCPatchCreateCellPatchFacets(PC pc, PetscSection *facetCou
     ierr = PetscMalloc1(totalFacets, &facetsArray); CHKERRQ(ierr);
     ierr = ISGetIndices(cells, &cellsArray); CHKERRQ(ierr);
     facetIndex = 0;
+    ierr = PCPatchGetMaxClosureSize_Private(dm, &maxPoints); CHKERRQ(ierr);
+    ierr = PetscMalloc1(maxPoints, &points); CHKERRQ(ierr);
+    ierr = PetscFree(patch->truncated); CHKERRQ(ierr);
+    ierr = PetscCalloc1(vEnd - vStart, &patch->truncated); CHKERRQ(ierr);
     for ( PetscInt v = vStart; v < vEnd; v++ ) {
-        PetscInt ndof, off;
+        PetscInt  ndof, off;
         ierr = PetscSectionGetDof(cellCounts, v, &ndof); CHKERRQ(ierr);
         ierr = PetscSectionGetOffset(cellCounts, v, &off); CHKERRQ(ierr);
-        if ( ndof <= 0 ) {
-            /* No cells around this vertex. */
-            continue;
-        }
-        PetscHashIClear(ht);
         for ( PetscInt ci = off; ci < ndof + off; ci++ ) {
-            const PetscInt c = cellsArray[ci];
-            PetscHashIAdd(ht, c, 0);
+            inPatch[cellsArray[ci] - cStart] = v;
         }
         for ( PetscInt ci = off; ci < ndof + off; ci++ ) {
             const PetscInt c = cellsArray[ci];
@@ -375,13 +872,19 @@ static PetscErrorCode PCPatchCreateCellPatchFacets(PC pc, PetscSection *facetCou
                 ierr = DMPlexGetSupportSize(dm, f, &numCells); CHKERRQ(ierr);
                 if (numCells == 1) {
                     /* This facet is on a process boundary, therefore
-                     * also a patch boundary */
+                     * also a patch boundary.  If it goes through the
+                     * vertex, cells of the star are missing. */
+                    if (!patch->truncated[v - vStart]) {
+                        ierr = PCPatchGetClosurePoints_Private(dm, f, maxPoints, &npoints, points); CHKERRQ(ierr);
+                        for ( PetscInt k = 0; k < npoints; k++ ) {
+                            if (points[k] == patch->patchVertices[v - vStart]) patch->truncated[v - vStart] = PETSC_TRUE;
+                        }
+                    }
                     ierr = PetscSectionAddDof(*facetCounts, v, 1); CHKERRQ(ierr);
                     goto addFacet;
                 } else {
                     for ( PetscInt k = 0; k < numCells; k++ ) {
-                        PetscHashIHasKey(ht, facetCells[k], flg);
-                        if (!flg) {
+                        if (inPatch[facetCells[k] - cStart] != v) {
                             /* Facet's cell is not in the patch, so
                              * it's on the patch boundary. */
                             ierr = PetscSectionAddDof(*facetCounts, v, 1); CHKERRQ(ierr);
@@ -401,7 +904,8 @@ static PetscErrorCode PCPatchCreateCellPatchFacets(PC pc, PetscSection *facetCou
     }
     ierr = DMLabelDestroyIndex(facetLabel); CHKERRQ(ierr);
     ierr = ISRestoreIndices(cells, &cellsArray); CHKERRQ(ierr);
-    PetscHashIDestroy(ht);
+    ierr = PetscFree(inPatch); CHKERRQ(ierr);
+    ierr = PetscFree(points); CHKERRQ(ierr);
 
     ierr = PetscSectionSetUp(*facetCounts); CHKERRQ(ierr);
     ierr = PetscRealloc(sizeof(PetscInt)*facetIndex, &facetsArray); CHKERRQ(ierr);
@@ -411,47 +915,350 @@ static PetscErrorCode PCPatchCreateCellPatchFacets(PC pc, PetscSection *facetCou
 }
 
 #undef __FUNCT__
-#define __FUNCT__ "PCPatchCreateCellPatchDiscretisationInfo"
+#define __FUNCT__ "PCPatchCreateFacetDofs_Private"
 /*
- * PCPatchCreateCellPatchDiscretisationInfo - Build the dof maps for cell patches
+ * PCPatchCreateFacetDofs_Private - Collect the dofs in the closure of
+ * each patch boundary facet.
  *
  * Input Parameters:
- * + dm - The DMPlex object defining the mesh
- * . cellCounts - Section with counts of cells around each vertex
- * . cells - IS of the cell point indices of cells in each patch
- * . facetCounts - Section with counts of boundary facets for each cell patch
- * . facets - IS of the boundary facet point indices for each cell patch.
- * . cellNumbering - Section mapping plex cell points to Firedrake cell indices.
- * . dofsPerCell - number of dofs per cell.
- * - cellNodeMap - map from cells to dof indices (dofsPerCell * numCells)
+ * + pc - The patch PC
+ * - facets - IS of the boundary facet point indices for each cell patch
  *
  * Output Parameters:
- * + dofs - IS of local dof numbers of each cell in the patch
- * . gtolCounts - Section with counts of dofs per cell patch
- * - gtol - IS mapping from global dofs to local dofs for each patch. 
+ * + facetDofOffsets - Offsets into facetDofs, indexed by facet - fStart
+ *                     (fEnd - fStart + 1 entries)
+ * - facetDofs - Local dofs in the closure of each facet
+ *
+ * Note:
+ *  Each facet is on the boundary of several patches, so its closure
+ *  is only computed once.  Only facets that appear in some patch
+ *  boundary get any entries.
  */
-static PetscErrorCode PCPatchCreateCellPatchDiscretisationInfo(PC pc,
-                                                               PetscSection facetCounts,
-                                                               IS facets)
+static PetscErrorCode PCPatchCreateFacetDofs_Private(PC pc, IS facets, PetscInt **facetDofOffsets, PetscInt **facetDofs)
 {
     PetscErrorCode  ierr;
-    PC_PATCH       *patch           = (PC_PATCH *)pc->data;
-    PetscSection    cellCounts      = patch->cellCounts;
-    PetscSection    gtolCounts;
-    IS              cells           = patch->cells;
-    PetscSection    cellNumbering   = patch->cellNumbering;
-    const PetscInt  dofsPerCell     = patch->nodesPerCell;
-    const PetscInt *cellNodeMap     = patch->cellNodeMap;
-    PetscInt        numCells;
-    PetscInt        numDofs;
-    PetscInt        numGlobalDofs;
-    PetscInt        vStart, vEnd;
-    const PetscInt *cellsArray;
-    PetscInt       *newCellsArray   = NULL;
-    PetscInt       *dofsArray       = NULL;
-    PetscInt       *globalDofsArray = NULL;
+    PC_PATCH       *patch      = (PC_PATCH *)pc->data;
+    DM              dm         = patch->dm;
+    PetscSection    dofSection = patch->dofSection;
+    PetscInt        fStart, fEnd, maxPoints, npoints, numFacets;
+    PetscInt        nFacetDofs, maxFacetDofs;
+    PetscInt       *points     = NULL;
+    PetscInt       *offsets    = NULL;
+    PetscInt       *dofs       = NULL;
+    const PetscInt *facetsArray;
+
+    PetscFunctionBegin;
+    ierr = DMPlexGetHeightStratum(dm, 1, &fStart, &fEnd); CHKERRQ(ierr);
+    ierr = PCPatchGetMaxClosureSize_Private(dm, &maxPoints); CHKERRQ(ierr);
+    ierr = PetscMalloc1(maxPoints, &points); CHKERRQ(ierr);
+    ierr = PetscMalloc1(fEnd - fStart + 1, &offsets); CHKERRQ(ierr);
+    for ( PetscInt f = 0; f <= fEnd - fStart; f++ ) offsets[f] = -1;
+    ierr = ISGetLocalSize(facets, &numFacets); CHKERRQ(ierr);
+    ierr = ISGetIndices(facets, &facetsArray); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < numFacets; i++ ) offsets[facetsArray[i] - fStart] = 0;
+    ierr = ISRestoreIndices(facets, &facetsArray); CHKERRQ(ierr);
+
+    maxFacetDofs = numFacets;
+    ierr = PetscMalloc1(maxFacetDofs, &dofs); CHKERRQ(ierr);
+    nFacetDofs = 0;
+    for ( PetscInt f = fStart; f < fEnd; f++ ) {
+        if (offsets[f - fStart] < 0) continue;
+        offsets[f - fStart] = nFacetDofs;
+        ierr = PCPatchGetClosurePoints_Private(dm, f, maxPoints, &npoints, points); CHKERRQ(ierr);
+        for ( PetscInt ci = 0; ci < npoints; ci++ ) {
+            PetscInt ldof, loff;
+            ierr = PetscSectionGetDof(dofSection, points[ci], &ldof); CHKERRQ(ierr);
+            ierr = PetscSectionGetOffset(dofSection, points[ci], &loff); CHKERRQ(ierr);
+            if (nFacetDofs + ldof > maxFacetDofs) {
+                maxFacetDofs = (PetscInt)((1 + maxFacetDofs + ldof)*1.5);
+                ierr = PetscRealloc(sizeof(PetscInt)*maxFacetDofs, &dofs); CHKERRQ(ierr);
+            }
+            for ( PetscInt j = loff; j < ldof + loff; j++ ) dofs[nFacetDofs++] = j;
+        }
+    }
+    ierr = PetscFree(points); CHKERRQ(ierr);
+    /* Fill in the gaps, so that offsets[f + 1] ends the entries of
+     * every recorded facet f. */
+    for ( PetscInt f = fEnd - fStart, next = nFacetDofs; f >= 0; f-- ) {
+        if (offsets[f] < 0) {
+            offsets[f] = next;
+        } else {
+            next = offsets[f];
+        }
+    }
+    *facetDofOffsets = offsets;
+    *facetDofs       = dofs;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchFindCellInteriorNodes"
+/*
+ * PCPatchFindCellInteriorNodes - Find the nodes of each cell that belong
+ * to the cell alone, for static condensation.
+ *
+ * Output Parameters:
+ * + cellInterior - For each node of a cell, is it interior?
+ * - condenseIdx - Cell local entries (node*bs + component), the
+ *                 interior ones first
+ *
+ * Note:
+ *  Interior nodes are those the dof section puts on the cell point
+ *  itself.  They must sit in the same place in every cell's node list,
+ *  as they do for a single element type.  If there are none, or
+ *  nothing else, condensation is turned off.
+ */
+static PetscErrorCode PCPatchFindCellInteriorNodes(PC pc)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    const PetscInt  npc   = patch->nodesPerCell;
+    const PetscInt  bs    = patch->bs;
+    PetscBool       first = PETSC_TRUE;
+    PetscInt        cStart, cEnd, ni = 0, nb = 0;
+
+    PetscFunctionBegin;
+    ierr = DMPlexGetHeightStratum(patch->dm, 0, &cStart, &cEnd); CHKERRQ(ierr);
+    ierr = PetscMalloc1(npc, &patch->cellInterior); CHKERRQ(ierr);
+    for ( PetscInt j = 0; j < npc; j++ ) patch->cellInterior[j] = PETSC_FALSE;
+    for ( PetscInt c = cStart; c < cEnd; c++ ) {
+        PetscInt cell, dof, off;
+        ierr = PetscSectionGetDof(patch->cellNumbering, c, &cell); CHKERRQ(ierr);
+        if (cell <= 0) continue;
+        ierr = PetscSectionGetOffset(patch->cellNumbering, c, &cell); CHKERRQ(ierr);
+        ierr = PetscSectionGetDof(patch->dofSection, c, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->dofSection, c, &off); CHKERRQ(ierr);
+        for ( PetscInt j = 0; j < npc; j++ ) {
+            const PetscInt  node = patch->cellNodeMap[cell*npc + j];
+            const PetscBool in   = (node >= off && node < off + dof) ? PETSC_TRUE : PETSC_FALSE;
+            if (node < 0) {
+                SETERRQ1(PETSC_COMM_SELF, PETSC_ERR_SUP, "Cell %D has unused nodes, can't condense\n", cell);
+            }
+            if (first) {
+                patch->cellInterior[j] = in;
+            } else if (patch->cellInterior[j] != in) {
+                SETERRQ1(PETSC_COMM_SELF, PETSC_ERR_SUP, "Cell %D has its interior nodes in a different place, can't condense\n", cell);
+            }
+        }
+        first = PETSC_FALSE;
+    }
+    for ( PetscInt j = 0; j < npc; j++ ) {
+        if (patch->cellInterior[j]) patch->ncellInterior++;
+    }
+    if (patch->ncellInterior == 0 || patch->ncellInterior == npc) {
+        ierr = PetscInfo(pc, "Cells have no interior nodes, or nothing else, not condensing\n"); CHKERRQ(ierr);
+        ierr = PetscFree(patch->cellInterior); CHKERRQ(ierr);
+        patch->ncellInterior = 0;
+        patch->condense      = PETSC_FALSE;
+        PetscFunctionReturn(0);
+    }
+    ierr = PetscMalloc1(npc*bs, &patch->condenseIdx); CHKERRQ(ierr);
+    for ( PetscInt j = 0; j < npc; j++ ) {
+        for ( PetscInt k = 0; k < bs; k++ ) {
+            if (patch->cellInterior[j]) {
+                patch->condenseIdx[ni++] = j*bs + k;
+            } else {
+                patch->condenseIdx[patch->ncellInterior*bs + nb++] = j*bs + k;
+            }
+        }
+    }
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchOrderRCM_Private"
+/*
+ * PCPatchOrderRCM_Private - Reverse Cuthill-McKee ordering of a graph.
+ *
+ * Input Parameters:
+ * + n - Number of vertices
+ * . offsets - CSR offsets of the adjacency (n + 1)
+ * - adj - Neighbours of each vertex
+ *
+ * Output Parameters:
+ * . order - The vertices in their new order (order[k] is the old
+ *           index of the k-th)
+ *
+ * Note:
+ *  Each connected component is walked breadth first from an unvisited
+ *  vertex of least degree, taking neighbours by increasing degree.
+ */
+static PetscErrorCode PCPatchOrderRCM_Private(PetscInt n, const PetscInt *offsets, const PetscInt *adj, PetscInt *order)
+{
+    PetscErrorCode  ierr;
+    PetscBool      *seen    = NULL;
+    PetscInt       *cand    = NULL;
+    PetscInt       *candDeg = NULL;
+    PetscInt       *key     = NULL;
+    PetscInt        maxDeg  = 0, head = 0, tail = 0, next = 0;
+
+    PetscFunctionBegin;
+    for ( PetscInt i = 0; i < n; i++ ) maxDeg = PetscMax(maxDeg, offsets[i + 1] - offsets[i]);
+    ierr = PetscMalloc4(n, &seen, n, &cand, n, &candDeg, maxDeg, &key); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < n; i++ ) {
+        seen[i]    = PETSC_FALSE;
+        cand[i]    = i;
+        candDeg[i] = offsets[i + 1] - offsets[i];
+    }
+    /* Starting vertices, least degree first. */
+    ierr = PetscSortIntWithArray(n, candDeg, cand); CHKERRQ(ierr);
+    while (tail < n) {
+        while (seen[cand[next]]) next++;
+        seen[cand[next]] = PETSC_TRUE;
+        order[tail++]    = cand[next];
+        while (head < tail) {
+            const PetscInt v = order[head++];
+            PetscInt       m = 0;
+            for ( PetscInt j = offsets[v]; j < offsets[v + 1]; j++ ) {
+                const PetscInt w = adj[j];
+                if (seen[w]) continue;
+                seen[w]         = PETSC_TRUE;
+                key[m]          = offsets[w + 1] - offsets[w];
+                order[tail + m] = w;
+                m++;
+            }
+            ierr = PetscSortIntWithArray(m, key, order + tail); CHKERRQ(ierr);
+            tail += m;
+        }
+    }
+    for ( PetscInt k = 0; k < n/2; k++ ) {
+        const PetscInt t = order[k];
+        order[k]         = order[n - 1 - k];
+        order[n - 1 - k] = t;
+    }
+    ierr = PetscFree4(seen, cand, candDeg, key); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchOrderPatchDofs_Private"
+/*
+ * PCPatchOrderPatchDofs_Private - Order the dofs of one patch for small
+ * bandwidth of its operator.
+ *
+ * Input Parameters:
+ * + ncell - Number of cells in the patch
+ * . npc - Nodes per cell
+ * . cellDofs - Patch local dof of each cell node (negative ones are
+ *              not in the patch)
+ * - n - Number of dofs in the patch
+ *
+ * Output Parameters:
+ * . order - The dofs in their new order (order[k] is the old number of
+ *           the k-th)
+ */
+static PetscErrorCode PCPatchOrderPatchDofs_Private(PetscInt ncell, PetscInt npc, const PetscInt *cellDofs, PetscInt n, PetscInt *order)
+{
+    PetscErrorCode  ierr;
+    PetscInt       *nodeCellOffsets = NULL;
+    PetscInt       *nodeCells       = NULL;
+    PetscInt       *offsets         = NULL;
+    PetscInt       *adj             = NULL;
+    PetscInt       *stamp           = NULL;
+
+    PetscFunctionBegin;
+    ierr = PetscCalloc2(n + 1, &nodeCellOffsets, n + 1, &offsets); CHKERRQ(ierr);
+    ierr = PetscMalloc3(ncell*npc, &nodeCells, ncell*npc*npc, &adj, n, &stamp); CHKERRQ(ierr);
+    /* Cells around each dof, as CSR. */
+    for ( PetscInt i = 0; i < ncell*npc; i++ ) {
+        if (cellDofs[i] >= 0) nodeCellOffsets[cellDofs[i] + 1]++;
+    }
+    for ( PetscInt k = 0; k < n; k++ ) nodeCellOffsets[k + 1] += nodeCellOffsets[k];
+    for ( PetscInt i = 0; i < ncell*npc; i++ ) {
+        if (cellDofs[i] >= 0) nodeCells[nodeCellOffsets[cellDofs[i]]++] = i/npc;
+    }
+    for ( PetscInt k = n; k > 0; k-- ) nodeCellOffsets[k] = nodeCellOffsets[k - 1];
+    nodeCellOffsets[0] = 0;
+    /* Dofs sharing a cell are adjacent. */
+    for ( PetscInt k = 0; k < n; k++ ) stamp[k] = -1;
+    for ( PetscInt r = 0; r < n; r++ ) {
+        stamp[r] = r;
+        offsets[r + 1] = offsets[r];
+        for ( PetscInt j = nodeCellOffsets[r]; j < nodeCellOffsets[r + 1]; j++ ) {
+            for ( PetscInt a = 0; a < npc; a++ ) {
+                const PetscInt col = cellDofs[nodeCells[j]*npc + a];
+                if (col < 0 || stamp[col] == r) continue;
+                stamp[col] = r;
+                adj[offsets[r + 1]++] = col;
+            }
+        }
+    }
+    ierr = PCPatchOrderRCM_Private(n, offsets, adj, order); CHKERRQ(ierr);
+    ierr = PetscFree2(nodeCellOffsets, offsets); CHKERRQ(ierr);
+    ierr = PetscFree3(nodeCells, adj, stamp); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCreateCellPatchDiscretisationInfo"
+/*
+ * PCPatchCreateCellPatchDiscretisationInfo - Build the dof maps and
+ * boundary conditions for cell patches
+ *
+ * Input Parameters:
+ * + dm - The DMPlex object defining the mesh
+ * . cellCounts - Section with counts of cells in each patch
+ * . cells - IS of the cell point indices of cells in each patch
+ * . facetCounts - Section with counts of boundary facets for each cell patch
+ * . facets - IS of the boundary facet point indices for each cell patch.
+ * . cellNumbering - Section mapping plex cell points to Firedrake cell indices.
+ * . dofsPerCell - number of dofs per cell.
+ * . cellNodeMap - map from cells to dof indices (dofsPerCell * numCells)
+ * - bcNodes - IS of global boundary condition nodes
+ *
+ * Output Parameters:
+ * + dofs - IS of local dof numbers of each cell in the patch
+ * . gtolCounts - Section with counts of dofs per cell patch
+ * . gtol - IS mapping from global dofs to local dofs for each patch.
+ * . bcCounts - Section with counts of boundary dofs per cell patch
+ * - bcs - For each patch, ISBlock of its boundary dofs (local numbering)
+ *
+ * Note:
+ *  Everything is built in a single pass over the patches.  Global to
+ *  local lookups go through dense arrays over the process local dofs,
+ *  which are valid for a patch only where stamped with its vertex, so
+ *  nothing needs clearing between patches.  When condensing, cell
+ *  interior nodes are left out of the patches and get a local dof of -1.
+ *  So do the boundary dofs of additive patches, which then have no
+ *  bcs: nothing is assembled there, and nothing need be zeroed.
+ *  Multiplicative patches keep them, for the residual updates.
+ */
+static PetscErrorCode PCPatchCreateCellPatchDiscretisationInfo(PC pc,
+                                                               PetscSection facetCounts,
+                                                               IS facets)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch           = (PC_PATCH *)pc->data;
+    PetscSection    cellCounts      = patch->cellCounts;
+    PetscSection    gtolCounts;
+    PetscSection    bcCounts;
+    IS              cells           = patch->cells;
+    PetscSection    cellNumbering   = patch->cellNumbering;
+    const PetscInt  dofsPerCell     = patch->nodesPerCell;
+    const PetscInt *cellNodeMap     = patch->cellNodeMap;
+    PetscInt        numCells;
+    PetscInt        numDofs;
+    PetscInt        numLocalDofs;
+    PetscInt        numBcs;
+    PetscInt        vStart, vEnd, fStart;
+    const PetscInt *cellsArray;
+    const PetscInt *facetsArray;
+    const PetscInt *bcNodes         = NULL;
+    PetscInt       *newCellsArray   = NULL;
+    PetscInt       *dofsArray       = NULL;
+    PetscInt       *globalDofsArray = NULL;
+    PetscInt       *facetDofOffsets = NULL;
+    PetscInt       *facetDofs       = NULL;
+    PetscBool      *globalBc        = NULL;
+    PetscInt       *stamp           = NULL;
+    PetscInt       *localDofs       = NULL;
+    PetscInt       *bcStamp         = NULL;
+    PetscInt       *renumber        = NULL;
+    PetscInt       *order           = NULL;
     PetscInt        globalIndex     = 0;
-    PetscHashI      ht;
+    PetscInt        gtolIndex       = 0;
+    /* Multiplicative residual updates need the boundary rows. */
+    const PetscBool eliminateBcs    = patch->type == PC_PATCH_ADDITIVE ? PETSC_TRUE : PETSC_FALSE;
     PetscFunctionBegin;
 
     /* dofcounts section is cellcounts section * dofPerCell */
@@ -459,17 +1266,47 @@ static PetscErrorCode PCPatchCreateCellPatchDiscretisationInfo(PC pc,
     numDofs = numCells * dofsPerCell;
     ierr = PetscMalloc1(numDofs, &dofsArray); CHKERRQ(ierr);
     ierr = PetscMalloc1(numCells, &newCellsArray); CHKERRQ(ierr);
+    /* A patch has at most as many dofs as its cells do. */
+    ierr = PetscMalloc1(numDofs, &globalDofsArray); CHKERRQ(ierr);
     ierr = PetscSectionGetChart(cellCounts, &vStart, &vEnd); CHKERRQ(ierr);
     ierr = PetscSectionCreate(PETSC_COMM_SELF, &patch->gtolCounts); CHKERRQ(ierr);
     gtolCounts = patch->gtolCounts;
     ierr = PetscSectionSetChart(gtolCounts, vStart, vEnd); CHKERRQ(ierr);
+    ierr = PetscSectionCreate(PETSC_COMM_SELF, &patch->bcCounts); CHKERRQ(ierr);
+    bcCounts = patch->bcCounts;
+    ierr = PetscSectionSetChart(bcCounts, vStart, vEnd); CHKERRQ(ierr);
+    ierr = PetscMalloc1(vEnd - vStart, &patch->bcs); CHKERRQ(ierr);
+    if (eliminateBcs || patch->reorder) {
+        ierr = PetscMalloc2(numDofs, &renumber, numDofs, &order); CHKERRQ(ierr);
+    }
 
-    ierr = ISGetIndices(cells, &cellsArray);
-    PetscHashICreate(ht);
+    ierr = PCPatchCreateFacetDofs_Private(pc, facets, &facetDofOffsets, &facetDofs); CHKERRQ(ierr);
+    ierr = DMPlexGetHeightStratum(patch->dm, 1, &fStart, NULL); CHKERRQ(ierr);
+
+    /* Marker arrays over the process local dofs. */
+    ierr = PetscSectionGetStorageSize(patch->dofSection, &numLocalDofs); CHKERRQ(ierr);
+    ierr = PetscMalloc4(numLocalDofs, &globalBc, numLocalDofs, &stamp,
+                        numLocalDofs, &localDofs, numLocalDofs, &bcStamp); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < numLocalDofs; i++ ) {
+        globalBc[i] = PETSC_FALSE;
+        stamp[i]    = -1;
+        bcStamp[i]  = -1;
+    }
+    ierr = ISGetSize(patch->bcNodes, &numBcs); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->bcNodes, &bcNodes); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < numBcs; i++ ) {
+        if (bcNodes[i] < numLocalDofs) globalBc[bcNodes[i]] = PETSC_TRUE;
+    }
+    ierr = ISRestoreIndices(patch->bcNodes, &bcNodes); CHKERRQ(ierr);
+
+    ierr = ISGetIndices(cells, &cellsArray); CHKERRQ(ierr);
+    ierr = ISGetIndices(facets, &facetsArray); CHKERRQ(ierr);
     for ( PetscInt v = vStart; v < vEnd; v++ ) {
-        PetscInt dof, off;
-        PetscInt localIndex = 0;
-        PetscHashIClear(ht);
+        PetscInt  dof, off;
+        PetscInt  localIndex = 0;
+        PetscInt  bcIndex    = 0;
+        PetscInt *bcsArray   = NULL;
+        const PetscInt cellIndex = globalIndex;
         ierr = PetscSectionGetDof(cellCounts, v, &dof); CHKERRQ(ierr);
         ierr = PetscSectionGetOffset(cellCounts, v, &off); CHKERRQ(ierr);
         for ( PetscInt i = off; i < off + dof; i++ ) {
@@ -486,215 +1323,513 @@ static PetscErrorCode PCPatchCreateCellPatchDiscretisationInfo(PC pc,
             for ( PetscInt j = 0; j < dofsPerCell; j++ ) {
                 /* For each global dof, map it into contiguous local storage. */
                 const PetscInt globalDof = cellNodeMap[cell*dofsPerCell + j];
-                PetscInt localDof;
-                PetscHashIMap(ht, globalDof, localDof);
-                if (localDof == -1) {
-                    localDof = localIndex++;
-                    PetscHashIAdd(ht, globalDof, localDof);
+                if ( globalDof >= numLocalDofs ) {
+                    SETERRQ1(PETSC_COMM_WORLD, PETSC_ERR_ARG_OUTOFRANGE,
+                             "Cell node map entry %D out of range", globalDof);
+                }
+                if (globalDof < 0) {
+                    /* Unused node: no patch dof, assembly ignores it. */
+                    dofsArray[globalIndex++] = -1;
+                    continue;
+                }
+                if (patch->cellInterior && patch->cellInterior[j]) {
+                    /* Condensed out, recovered cell by cell. */
+                    dofsArray[globalIndex++] = -1;
+                    continue;
+                }
+                if (stamp[globalDof] != v) {
+                    stamp[globalDof] = v;
+                    localDofs[globalDof] = localIndex++;
+                    globalDofsArray[gtolIndex++] = globalDof;
                 }
                 if ( globalIndex >= numDofs ) {
                     SETERRQ(PETSC_COMM_WORLD, PETSC_ERR_ARG_OUTOFRANGE,
                             "Found more dofs than expected");
                 }
                 /* And store. */
-                dofsArray[globalIndex++] = localDof;
+                dofsArray[globalIndex++] = localDofs[globalDof];
             }
         }
-        PetscHashISize(ht, dof);
-        /* How many local dofs in this patch? */
-        ierr = PetscSectionSetDof(gtolCounts, v, dof); CHKERRQ(ierr);
-    }
-    ierr = PetscSectionSetUp(gtolCounts); CHKERRQ(ierr);
-    ierr = PetscSectionGetStorageSize(gtolCounts, &numGlobalDofs); CHKERRQ(ierr);
-    ierr = PetscMalloc1(numGlobalDofs, &globalDofsArray); CHKERRQ(ierr);
-
-    /* Now populate the global to local map.  This could be merged
-    * into the above loop if we were willing to deal with reallocs. */
-    for ( PetscInt v = vStart; v < vEnd; v++ ) {
-        PetscInt       dof, off;
-        PetscHashIIter hi;
-        PetscHashIClear(ht);
-        ierr = PetscSectionGetDof(cellCounts, v, &dof); CHKERRQ(ierr);
-        ierr = PetscSectionGetOffset(cellCounts, v, &off); CHKERRQ(ierr);
+        if (patch->reorder && localIndex > 2) {
+            /* Renumber for small bandwidth, before anything else is
+             * looked up in localDofs. */
+            const PetscInt start = gtolIndex - localIndex;
+            ierr = PCPatchOrderPatchDofs_Private(dof, dofsPerCell, dofsArray + cellIndex, localIndex, order); CHKERRQ(ierr);
+            for ( PetscInt k = 0; k < localIndex; k++ ) renumber[k] = globalDofsArray[start + order[k]];
+            for ( PetscInt k = 0; k < localIndex; k++ ) {
+                globalDofsArray[start + k] = renumber[k];
+                localDofs[renumber[k]]     = k;
+            }
+            for ( PetscInt k = 0; k < localIndex; k++ ) renumber[order[k]] = k;
+            for ( PetscInt i = cellIndex; i < globalIndex; i++ ) {
+                if (dofsArray[i] >= 0) dofsArray[i] = renumber[dofsArray[i]];
+            }
+        }
+        /* Boundary conditions: global ones, then the dofs on the patch
+         * boundary facets.  There can't be more than the patch has
+         * dofs. */
+        ierr = PetscMalloc1(localIndex, &bcsArray); CHKERRQ(ierr);
+        for ( PetscInt i = gtolIndex - localIndex; i < gtolIndex; i++ ) {
+            const PetscInt globalDof = globalDofsArray[i];
+            if (globalBc[globalDof]) {
+                bcStamp[globalDof] = v;
+                bcsArray[bcIndex++] = localDofs[globalDof];
+            }
+        }
+        ierr = PetscSectionGetDof(facetCounts, v, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(facetCounts, v, &off); CHKERRQ(ierr);
         for ( PetscInt i = off; i < off + dof; i++ ) {
-            /* Reconstruct mapping of global-to-local on this patch. */
-            const PetscInt c = cellsArray[i];
-            PetscInt cell;
-            ierr = PetscSectionGetOffset(cellNumbering, c, &cell); CHKERRQ(ierr);
-            for ( PetscInt j = 0; j < dofsPerCell; j++ ) {
-                const PetscInt globalDof = cellNodeMap[cell*dofsPerCell + j];
-                const PetscInt localDof = dofsArray[i*dofsPerCell + j];
-                PetscHashIAdd(ht, globalDof, localDof);
+            const PetscInt f = facetsArray[i] - fStart;
+            for ( PetscInt j = facetDofOffsets[f]; j < facetDofOffsets[f + 1]; j++ ) {
+                const PetscInt globalDof = facetDofs[j];
+                if ( stamp[globalDof] != v ) {
+                    SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_OUTOFRANGE,
+                            "Didn't find facet dof in patch dof\n");
+                }
+                if (bcStamp[globalDof] == v) continue;
+                bcStamp[globalDof] = v;
+                bcsArray[bcIndex++] = localDofs[globalDof];
             }
         }
-        if (dof > 0) {
-            /* Shove it in the output data structure. */
-            ierr = PetscSectionGetOffset(gtolCounts, v, &off); CHKERRQ(ierr);
-            PetscHashIIterBegin(ht, hi);
-            while (!PetscHashIIterAtEnd(ht, hi)) {
-                PetscInt globalDof, localDof;
-                PetscHashIIterGetKeyVal(ht, hi, globalDof, localDof);
-                if (globalDof >= 0) {
-                    globalDofsArray[off + localDof] = globalDof;
+        if (eliminateBcs) {
+            /* Number only the free dofs, the boundary ones get -1 and
+             * so are dropped by MatSetValues.  Compacts this patch's
+             * gtol in place. */
+            const PetscInt start = gtolIndex - localIndex;
+            PetscInt       n     = 0;
+            for ( PetscInt k = 0; k < localIndex; k++ ) {
+                const PetscInt globalDof = globalDofsArray[start + k];
+                if (bcStamp[globalDof] == v) {
+                    renumber[k] = -1;
+                } else {
+                    renumber[k] = n;
+                    globalDofsArray[start + n++] = globalDof;
                 }
-                PetscHashIIterNext(ht, hi);
             }
+            for ( PetscInt i = cellIndex; i < globalIndex; i++ ) {
+                if (dofsArray[i] >= 0) dofsArray[i] = renumber[dofsArray[i]];
+            }
+            gtolIndex  = start + n;
+            localIndex = n;
+            bcIndex    = 0;
         }
+        /* How many local dofs in this patch? */
+        ierr = PetscSectionSetDof(gtolCounts, v, localIndex); CHKERRQ(ierr);
+        ierr = PetscSortInt(bcIndex, bcsArray); CHKERRQ(ierr);
+        ierr = PetscSectionSetDof(bcCounts, v, bcIndex); CHKERRQ(ierr);
+        ierr = ISCreateBlock(PETSC_COMM_SELF, patch->bs, bcIndex, bcsArray, PETSC_OWN_POINTER, &(patch->bcs[v - vStart])); CHKERRQ(ierr);
     }
-    PetscHashIDestroy(ht);
-    ierr = ISRestoreIndices(cells, &cellsArray);
+    ierr = ISRestoreIndices(cells, &cellsArray); CHKERRQ(ierr);
+    ierr = ISRestoreIndices(facets, &facetsArray); CHKERRQ(ierr);
+    ierr = PetscFree4(globalBc, stamp, localDofs, bcStamp); CHKERRQ(ierr);
+    ierr = PetscFree2(renumber, order); CHKERRQ(ierr);
+    ierr = PetscFree(facetDofOffsets); CHKERRQ(ierr);
+    ierr = PetscFree(facetDofs); CHKERRQ(ierr);
+
+    ierr = PetscSectionSetUp(gtolCounts); CHKERRQ(ierr);
+    ierr = PetscSectionSetUp(bcCounts); CHKERRQ(ierr);
+    ierr = PetscRealloc(sizeof(PetscInt)*gtolIndex, &globalDofsArray); CHKERRQ(ierr);
 
     /* Replace cell indices with firedrake-numbered ones. */
     ierr = ISGeneralSetIndices(cells, numCells, (const PetscInt *)newCellsArray, PETSC_OWN_POINTER); CHKERRQ(ierr);
-    ierr = ISCreateGeneral(PETSC_COMM_SELF, numGlobalDofs, globalDofsArray, PETSC_OWN_POINTER, &patch->gtol); CHKERRQ(ierr);
+    ierr = ISCreateGeneral(PETSC_COMM_SELF, gtolIndex, globalDofsArray, PETSC_OWN_POINTER, &patch->gtol); CHKERRQ(ierr);
     ierr = ISCreateGeneral(PETSC_COMM_SELF, numDofs, dofsArray, PETSC_OWN_POINTER, &patch->dofs); CHKERRQ(ierr);
     PetscFunctionReturn(0);
 }
 
 #undef __FUNCT__
-#define __FUNCT__ "PCPatchCreateCellPatchBCs"
-static PetscErrorCode PCPatchCreateCellPatchBCs(PC pc,
-                                                PetscSection facetCounts,
-                                                IS facets)
+#define __FUNCT__ "PCPatchSquashEmptyPatches_Private"
+/*
+ * PCPatchSquashEmptyPatches_Private - Drop the patches left without
+ * dofs (all boundary, say), renumbering the rest from zero.
+ *
+ * Note:
+ *  Such patches have no gtol or bcs entries, so only the cell data and
+ *  the sections over patches need compacting.
+ */
+static PetscErrorCode PCPatchSquashEmptyPatches_Private(PC pc)
 {
     PetscErrorCode  ierr;
-    PC_PATCH       *patch      = (PC_PATCH *)pc->data;
-    DM              dm         = patch->dm;
-    PetscInt        numBcs;
-    const PetscInt *bcNodes    = NULL;
-    PetscSection    dofSection = patch->dofSection;
-    PetscSection    gtolCounts = patch->gtolCounts;
-    PetscSection    bcCounts;
-    IS              gtol = patch->gtol;
-    PetscHashI      globalBcs;
-    PetscHashI      localBcs;
-    PetscHashI      patchDofs;
-    PetscInt       *bcsArray   = NULL;
-    PetscInt        vStart, vEnd;
-    PetscInt        closureSize;
-    PetscInt       *closure    = NULL;
-    const PetscInt *gtolArray;
-    const PetscInt *facetsArray;
-    PetscFunctionBegin;
+    PC_PATCH       *patch   = (PC_PATCH *)pc->data;
+    const PetscInt  npc     = patch->nodesPerCell;
+    PetscSection    cellCounts, gtolCounts, bcCounts;
+    const PetscInt *cellsArray, *dofsArray;
+    PetscInt       *newCells = NULL, *newDofs = NULL;
+    PetscInt        npatch   = 0, ncell = 0;
 
-    PetscHashICreate(globalBcs);
-    ierr = ISGetIndices(patch->bcNodes, &bcNodes); CHKERRQ(ierr);
-    ierr = ISGetSize(patch->bcNodes, &numBcs); CHKERRQ(ierr);
-    for ( PetscInt i = 0; i < numBcs; i++ ) {
-        PetscHashIAdd(globalBcs, bcNodes[i], 0);
+    PetscFunctionBegin;
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        PetscInt dof;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i, &dof); CHKERRQ(ierr);
+        if (dof > 0) npatch++;
     }
-    ierr = ISRestoreIndices(patch->bcNodes, &bcNodes); CHKERRQ(ierr);
-    PetscHashICreate(patchDofs);
-    PetscHashICreate(localBcs);
-
-    ierr = PetscSectionGetChart(facetCounts, &vStart, &vEnd); CHKERRQ(ierr);
-    ierr = PetscSectionCreate(PETSC_COMM_SELF, &patch->bcCounts); CHKERRQ(ierr);
-    bcCounts = patch->bcCounts;
-    ierr = PetscSectionSetChart(bcCounts, vStart, vEnd); CHKERRQ(ierr);
-    ierr = PetscMalloc1(vEnd - vStart, &patch->bcs); CHKERRQ(ierr);
+    if (npatch == patch->npatch) PetscFunctionReturn(0);
+    ierr = PetscInfo2(pc, "Dropping %D of %D patches without dofs\n", patch->npatch - npatch, patch->npatch); CHKERRQ(ierr);
 
-    ierr = ISGetIndices(gtol, &gtolArray); CHKERRQ(ierr);
-    ierr = ISGetIndices(facets, &facetsArray); CHKERRQ(ierr);
-    for ( PetscInt v = vStart; v < vEnd; v++ ) {
-        PetscInt numBcs, dof, off;
-        PetscInt bcIndex = 0;
-        PetscHashIClear(patchDofs);
-        PetscHashIClear(localBcs);
-        ierr = PetscSectionGetDof(gtolCounts, v, &dof); CHKERRQ(ierr);
-        ierr = PetscSectionGetOffset(gtolCounts, v, &off); CHKERRQ(ierr);
-        for ( PetscInt i = off; i < off + dof; i++ ) {
-            PetscBool flg;
-            const PetscInt globalDof = gtolArray[i];
-            const PetscInt localDof = i - off;
-            PetscHashIAdd(patchDofs, globalDof, localDof);
-            PetscHashIHasKey(globalBcs, globalDof, flg);
-            if (flg) {
-                PetscHashIAdd(localBcs, localDof, 0);
-            }
-        }
-        ierr = PetscSectionGetDof(facetCounts, v, &dof); CHKERRQ(ierr);
-        ierr = PetscSectionGetOffset(facetCounts, v, &off); CHKERRQ(ierr);
-        for ( PetscInt i = off; i < off + dof; i++ ) {
-            const PetscInt f = facetsArray[i];
-            ierr = DMPlexGetTransitiveClosure(dm, f, PETSC_TRUE, &closureSize, &closure); CHKERRQ(ierr);
-            for ( PetscInt ci = 0; ci < closureSize; ci++ ) {
-                PetscInt ldof, loff;
-                const PetscInt p = closure[2*ci];
-                ierr = PetscSectionGetDof(dofSection, p, &ldof); CHKERRQ(ierr);
-                ierr = PetscSectionGetOffset(dofSection, p, &loff); CHKERRQ(ierr);
-                if ( ldof > 0 ) {
-                    for ( PetscInt j = loff; j < ldof + loff; j++ ) {
-                        PetscInt localDof;
-                        PetscHashIMap(patchDofs, j, localDof);
-                        if ( localDof == -1 ) {
-                            SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_OUTOFRANGE,
-                                    "Didn't find facet dof in patch dof\n");
-                        }
-                        PetscHashIAdd(localBcs, localDof, 0);
-                    }
-                }
-            }
+    ierr = PetscSectionCreate(PETSC_COMM_SELF, &cellCounts); CHKERRQ(ierr);
+    ierr = PetscSectionCreate(PETSC_COMM_SELF, &gtolCounts); CHKERRQ(ierr);
+    ierr = PetscSectionCreate(PETSC_COMM_SELF, &bcCounts); CHKERRQ(ierr);
+    ierr = PetscSectionSetChart(cellCounts, 0, npatch); CHKERRQ(ierr);
+    ierr = PetscSectionSetChart(gtolCounts, 0, npatch); CHKERRQ(ierr);
+    ierr = PetscSectionSetChart(bcCounts, 0, npatch); CHKERRQ(ierr);
+    npatch = 0;
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        PetscInt dof, ndof, nbc;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i, &ndof); CHKERRQ(ierr);
+        if (ndof <= 0) {
+            ierr = ISDestroy(&patch->bcs[i]); CHKERRQ(ierr);
+            continue;
         }
-        /* OK, now we have a hash table with all the bcs indicated by
-         * the facets and global bcs */
-        PetscHashISize(localBcs, numBcs);
-        ierr = PetscSectionSetDof(bcCounts, v, numBcs); CHKERRQ(ierr);
-        ierr = PetscMalloc1(numBcs, &bcsArray); CHKERRQ(ierr);
-        ierr = PetscHashIGetKeys(localBcs, &bcIndex, bcsArray); CHKERRQ(ierr);
-        ierr = PetscSortInt(numBcs, bcsArray); CHKERRQ(ierr);
-        ierr = ISCreateBlock(PETSC_COMM_SELF, patch->bs, numBcs, bcsArray, PETSC_OWN_POINTER, &(patch->bcs[v - vStart])); CHKERRQ(ierr);
-    }
-    if (closure) {
-        ierr = DMPlexRestoreTransitiveClosure(dm, 0, PETSC_TRUE, &closureSize, &closure); CHKERRQ(ierr);
+        ierr = PetscSectionGetDof(patch->cellCounts, i, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetDof(patch->bcCounts, i, &nbc); CHKERRQ(ierr);
+        ierr = PetscSectionSetDof(cellCounts, npatch, dof); CHKERRQ(ierr);
+        ierr = PetscSectionSetDof(gtolCounts, npatch, ndof); CHKERRQ(ierr);
+        ierr = PetscSectionSetDof(bcCounts, npatch, nbc); CHKERRQ(ierr);
+        patch->bcs[npatch]           = patch->bcs[i];
+        patch->patchVertices[npatch] = patch->patchVertices[i];
+        if (patch->truncated) patch->truncated[npatch] = patch->truncated[i];
+        ncell += dof;
+        npatch++;
     }
-    ierr = ISRestoreIndices(gtol, &gtolArray); CHKERRQ(ierr);
-    ierr = ISRestoreIndices(facets, &facetsArray); CHKERRQ(ierr);
-    PetscHashIDestroy(localBcs);
-    PetscHashIDestroy(patchDofs);
-    PetscHashIDestroy(globalBcs);
-
+    ierr = PetscSectionSetUp(cellCounts); CHKERRQ(ierr);
+    ierr = PetscSectionSetUp(gtolCounts); CHKERRQ(ierr);
     ierr = PetscSectionSetUp(bcCounts); CHKERRQ(ierr);
 
+    /* Cells and their dofs, in the surviving patches. */
+    ierr = PetscMalloc1(ncell, &newCells); CHKERRQ(ierr);
+    ierr = PetscMalloc1(ncell*npc, &newDofs); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->dofs, &dofsArray); CHKERRQ(ierr);
+    ncell = 0;
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        PetscInt dof, off, ndof;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i, &ndof); CHKERRQ(ierr);
+        if (ndof <= 0) continue;
+        ierr = PetscSectionGetDof(patch->cellCounts, i, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->cellCounts, i, &off); CHKERRQ(ierr);
+        ierr = PetscMemcpy(newCells + ncell, cellsArray + off, dof*sizeof(PetscInt)); CHKERRQ(ierr);
+        ierr = PetscMemcpy(newDofs + ncell*npc, dofsArray + off*npc, dof*npc*sizeof(PetscInt)); CHKERRQ(ierr);
+        ncell += dof;
+    }
+    ierr = ISRestoreIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    ierr = ISRestoreIndices(patch->dofs, &dofsArray); CHKERRQ(ierr);
+    ierr = ISGeneralSetIndices(patch->cells, ncell, newCells, PETSC_OWN_POINTER); CHKERRQ(ierr);
+    ierr = ISGeneralSetIndices(patch->dofs, ncell*npc, newDofs, PETSC_OWN_POINTER); CHKERRQ(ierr);
+
+    ierr = PetscSectionDestroy(&patch->cellCounts); CHKERRQ(ierr);
+    ierr = PetscSectionDestroy(&patch->gtolCounts); CHKERRQ(ierr);
+    ierr = PetscSectionDestroy(&patch->bcCounts); CHKERRQ(ierr);
+    patch->cellCounts = cellCounts;
+    patch->gtolCounts = gtolCounts;
+    patch->bcCounts   = bcCounts;
+    patch->npatch     = npatch;
     PetscFunctionReturn(0);
 }
 
 #undef __FUNCT__
-#define __FUNCT__ "PCReset_PATCH"
-static PetscErrorCode PCReset_PATCH(PC pc)
+#define __FUNCT__ "PCPatchEstimateWork"
+/*
+ * PCPatchEstimateWork - Estimate the work of each patch, and how evenly
+ * it is spread over the processes.
+ *
+ * Output Parameters:
+ * + patchCost - n^3 for a patch with n scalar dofs (a dense LU)
+ * - costLocal, costMin, costMax, costMean - Total on this process, and
+ *                                            its spread over processes
+ *
+ * Note:
+ *  Patches follow the vertices, so this can't move them between
+ *  processes (their cells and coefficients are only local there).  It
+ *  reports the imbalance, and the threaded sweep uses the costs to
+ *  start the biggest patches first.
+ */
+static PetscErrorCode PCPatchEstimateWork(PC pc)
 {
     PetscErrorCode  ierr;
     PC_PATCH       *patch = (PC_PATCH *)pc->data;
-    PetscInt        i;
+    PetscReal       in[2], out[2], sum;
+    PetscMPIInt     size;
 
     PetscFunctionBegin;
-    ierr = DMDestroy(&patch->dm); CHKERRQ(ierr);
-    ierr = PetscSFDestroy(&patch->defaultSF); CHKERRQ(ierr);
-    ierr = PetscSectionDestroy(&patch->dofSection); CHKERRQ(ierr);
-    ierr = PetscSectionDestroy(&patch->cellCounts); CHKERRQ(ierr);
-    ierr = PetscSectionDestroy(&patch->cellNumbering); CHKERRQ(ierr);
-    ierr = PetscSectionDestroy(&patch->gtolCounts); CHKERRQ(ierr);
-    ierr = PetscSectionDestroy(&patch->bcCounts); CHKERRQ(ierr);
-    ierr = ISDestroy(&patch->gtol); CHKERRQ(ierr);
-    ierr = ISDestroy(&patch->cells); CHKERRQ(ierr);
-    ierr = ISDestroy(&patch->dofs); CHKERRQ(ierr);
-    ierr = ISDestroy(&patch->bcNodes); CHKERRQ(ierr);
-    if (patch->bcs) {
-        for ( i = 0; i < patch->npatch; i++ ) {
-            ierr = ISDestroy(&patch->bcs[i]); CHKERRQ(ierr);
-        }
-        ierr = PetscFree(patch->bcs); CHKERRQ(ierr);
+    ierr = PetscMalloc1(patch->npatch, &patch->patchCost); CHKERRQ(ierr);
+    patch->costLocal = 0;
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        PetscInt dof;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i, &dof); CHKERRQ(ierr);
+        dof *= patch->bs;
+        patch->patchCost[i] = (PetscReal)dof*dof*dof;
+        patch->costLocal   += patch->patchCost[i];
     }
+    ierr = MPI_Comm_size(PetscObjectComm((PetscObject)pc), &size); CHKERRQ(ierr);
+    /* Max and min in one reduction. */
+    in[0] = patch->costLocal;
+    in[1] = -patch->costLocal;
+    ierr = MPIU_Allreduce(in, out, 2, MPIU_REAL, MPIU_MAX, PetscObjectComm((PetscObject)pc)); CHKERRQ(ierr);
+    ierr = MPIU_Allreduce(&patch->costLocal, &sum, 1, MPIU_REAL, MPIU_SUM, PetscObjectComm((PetscObject)pc)); CHKERRQ(ierr);
+    patch->costMax  = out[0];
+    patch->costMin  = -out[1];
+    patch->costMean = sum/size;
+    ierr = PetscInfo3(pc, "Estimated patch work per process: min %g, max %g, mean %g\n",
+                      (double)patch->costMin, (double)patch->costMax, (double)patch->costMean); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
 
-    if (patch->free_type) {
-        ierr = MPI_Type_free(&patch->data_type); CHKERRQ(ierr);
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCreatePatchOrder"
+/*
+ * PCPatchCreatePatchOrder - Order the patches by RCM on the graph of
+ * patches sharing a cell, so that patches applied one after the other
+ * touch nearby parts of the local vectors.
+ *
+ * Output Parameters:
+ * . patchOrder - The patch indices (from zero) in the order to apply them
+ */
+static PetscErrorCode PCPatchCreatePatchOrder(PC pc)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch        = (PC_PATCH *)pc->data;
+    const PetscInt  npatch       = patch->npatch;
+    const PetscInt *cellsArray;
+    PetscInt        pStart, numCells;
+    PetscInt        ncell        = 0;
+    PetscInt       *cellOffsets  = NULL;
+    PetscInt       *cellPatches  = NULL;
+    PetscInt       *offsets      = NULL;
+    PetscInt       *adj          = NULL;
+    PetscInt       *stamp        = NULL;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->cellCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = PetscSectionGetStorageSize(patch->cellCounts, &numCells); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < numCells; i++ ) ncell = PetscMax(ncell, cellsArray[i] + 1);
+    /* Patches around each cell, as CSR. */
+    ierr = PetscCalloc2(ncell + 1, &cellOffsets, npatch + 1, &offsets); CHKERRQ(ierr);
+    ierr = PetscMalloc2(numCells, &cellPatches, npatch, &stamp); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < numCells; i++ ) cellOffsets[cellsArray[i] + 1]++;
+    for ( PetscInt c = 0; c < ncell; c++ ) cellOffsets[c + 1] += cellOffsets[c];
+    for ( PetscInt i = 0; i < npatch; i++ ) {
+        PetscInt dof, off;
+        ierr = PetscSectionGetDof(patch->cellCounts, i + pStart, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->cellCounts, i + pStart, &off); CHKERRQ(ierr);
+        for ( PetscInt j = off; j < off + dof; j++ ) cellPatches[cellOffsets[cellsArray[j]]++] = i;
+    }
+    for ( PetscInt c = ncell; c > 0; c-- ) cellOffsets[c] = cellOffsets[c - 1];
+    cellOffsets[0] = 0;
+    /* Neighbours of each patch, counted then filled. */
+    for ( PetscInt pass = 0; pass < 2; pass++ ) {
+        for ( PetscInt i = 0; i < npatch; i++ ) stamp[i] = -1;
+        for ( PetscInt i = 0; i < npatch; i++ ) {
+            PetscInt dof, off, m = 0;
+            ierr = PetscSectionGetDof(patch->cellCounts, i + pStart, &dof); CHKERRQ(ierr);
+            ierr = PetscSectionGetOffset(patch->cellCounts, i + pStart, &off); CHKERRQ(ierr);
+            stamp[i] = i;
+            for ( PetscInt j = off; j < off + dof; j++ ) {
+                const PetscInt c = cellsArray[j];
+                for ( PetscInt k = cellOffsets[c]; k < cellOffsets[c + 1]; k++ ) {
+                    const PetscInt q = cellPatches[k];
+                    if (stamp[q] == i) continue;
+                    stamp[q] = i;
+                    if (pass) adj[offsets[i] + m] = q;
+                    m++;
+                }
+            }
+            if (!pass) offsets[i + 1] = offsets[i] + m;
+        }
+        if (!pass) {
+            ierr = PetscMalloc1(offsets[npatch], &adj); CHKERRQ(ierr);
+        }
+    }
+    ierr = ISRestoreIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    ierr = PetscMalloc1(npatch, &patch->patchOrder); CHKERRQ(ierr);
+    ierr = PCPatchOrderRCM_Private(npatch, offsets, adj, patch->patchOrder); CHKERRQ(ierr);
+    ierr = PetscFree(adj); CHKERRQ(ierr);
+    ierr = PetscFree2(cellOffsets, offsets); CHKERRQ(ierr);
+    ierr = PetscFree2(cellPatches, stamp); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCreateColouring"
+/*
+ * PCPatchCreateColouring - Greedily colour the patches so that no two
+ * patches of the same colour touch the same dof.
+ *
+ * Input Parameters:
+ * + gtolCounts - Section with counts of dofs per cell patch
+ * - gtol - IS mapping from global dofs to local dofs for each patch.
+ *
+ * Output Parameters:
+ * + colourCounts - Section with counts of patches of each colour
+ * - colourPatches - IS of the patch indices (from zero) of each colour
+ *
+ * Note:
+ *  Empty patches are not coloured.  Patches within a colour can be
+ *  solved and added into the local vector concurrently.  They are taken
+ *  in patchOrder, if there is one.  With cost estimates, each colour is
+ *  then sorted biggest patch first, keeping patchOrder among patches of
+ *  equal cost.
+ */
+static PetscErrorCode PCPatchCreateColouring(PC pc)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch          = (PC_PATCH *)pc->data;
+    PetscInt        pStart, pEnd, localSize;
+    PetscInt        ncolour        = 0;
+    PetscInt        nleft          = 0;
+    PetscInt        ncoloured      = 0;
+    PetscInt       *dofColour      = NULL;
+    PetscInt       *patchColour    = NULL;
+    PetscInt       *colourPatches  = NULL;
+    PetscInt       *colourOffsets  = NULL;
+    const PetscInt *gtolArray;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, &pEnd); CHKERRQ(ierr);
+    ierr = PetscSectionGetStorageSize(patch->dofSection, &localSize); CHKERRQ(ierr);
+    ierr = PetscMalloc1(localSize, &dofColour); CHKERRQ(ierr);
+    ierr = PetscMalloc1(pEnd - pStart, &patchColour); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < localSize; i++ ) dofColour[i] = -1;
+    for ( PetscInt p = pStart; p < pEnd; p++ ) {
+        PetscInt dof;
+        ierr = PetscSectionGetDof(patch->gtolCounts, p, &dof); CHKERRQ(ierr);
+        patchColour[p - pStart] = dof > 0 ? -1 : PETSC_MAX_INT;
+        if (dof > 0) nleft++;
+    }
+
+    ierr = ISGetIndices(patch->gtol, &gtolArray); CHKERRQ(ierr);
+    /* One sweep per colour: take every uncoloured patch that doesn't
+     * touch a dof already claimed by this colour. */
+    while (nleft > 0) {
+        for ( PetscInt k = 0; k < pEnd - pStart; k++ ) {
+            const PetscInt p = (patch->patchOrder ? patch->patchOrder[k] : k) + pStart;
+            PetscInt  dof, off;
+            PetscBool conflict = PETSC_FALSE;
+            if (patchColour[p - pStart] != -1) continue;
+            ierr = PetscSectionGetDof(patch->gtolCounts, p, &dof); CHKERRQ(ierr);
+            ierr = PetscSectionGetOffset(patch->gtolCounts, p, &off); CHKERRQ(ierr);
+            for ( PetscInt i = off; i < off + dof; i++ ) {
+                if (dofColour[gtolArray[i]] == ncolour) {
+                    conflict = PETSC_TRUE;
+                    break;
+                }
+            }
+            if (conflict) continue;
+            for ( PetscInt i = off; i < off + dof; i++ ) {
+                dofColour[gtolArray[i]] = ncolour;
+            }
+            patchColour[p - pStart] = ncolour;
+            nleft--;
+        }
+        ncolour++;
+    }
+    ierr = ISRestoreIndices(patch->gtol, &gtolArray); CHKERRQ(ierr);
+
+    ierr = PetscSectionCreate(PETSC_COMM_SELF, &patch->colourCounts); CHKERRQ(ierr);
+    ierr = PetscSectionSetChart(patch->colourCounts, 0, ncolour); CHKERRQ(ierr);
+    for ( PetscInt p = pStart; p < pEnd; p++ ) {
+        if (patchColour[p - pStart] == PETSC_MAX_INT) continue;
+        ierr = PetscSectionAddDof(patch->colourCounts, patchColour[p - pStart], 1); CHKERRQ(ierr);
+        ncoloured++;
+    }
+    ierr = PetscSectionSetUp(patch->colourCounts); CHKERRQ(ierr);
+    ierr = PetscMalloc1(ncoloured, &colourPatches); CHKERRQ(ierr);
+    ierr = PetscCalloc1(ncolour, &colourOffsets); CHKERRQ(ierr);
+    for ( PetscInt k = 0; k < pEnd - pStart; k++ ) {
+        const PetscInt p = (patch->patchOrder ? patch->patchOrder[k] : k) + pStart;
+        const PetscInt c = patchColour[p - pStart];
+        PetscInt       off;
+        if (c == PETSC_MAX_INT) continue;
+        ierr = PetscSectionGetOffset(patch->colourCounts, c, &off); CHKERRQ(ierr);
+        colourPatches[off + colourOffsets[c]++] = p - pStart;
+    }
+    if (patch->patchCost) {
+        /* Biggest patches first in each colour, so the dynamic
+         * schedule doesn't end waiting on one big patch.  The sort
+         * isn't stable, so ties are put back in patchOrder. */
+        PetscReal *key  = NULL;
+        PetscInt  *perm = NULL, *sorted = NULL;
+        ierr = PetscMalloc3(ncoloured, &key, ncoloured, &perm, ncoloured, &sorted); CHKERRQ(ierr);
+        for ( PetscInt c = 0; c < ncolour; c++ ) {
+            PetscInt cdof, coff;
+            ierr = PetscSectionGetDof(patch->colourCounts, c, &cdof); CHKERRQ(ierr);
+            ierr = PetscSectionGetOffset(patch->colourCounts, c, &coff); CHKERRQ(ierr);
+            for ( PetscInt k = 0; k < cdof; k++ ) {
+                key[k]  = -patch->patchCost[colourPatches[coff + k]];
+                perm[k] = k;
+            }
+            ierr = PetscSortRealWithPermutation(cdof, key, perm); CHKERRQ(ierr);
+            for ( PetscInt k = 0, l; k < cdof; k = l ) {
+                for ( l = k + 1; l < cdof && key[perm[l]] == key[perm[k]]; l++ );
+                ierr = PetscSortInt(l - k, perm + k); CHKERRQ(ierr);
+            }
+            for ( PetscInt k = 0; k < cdof; k++ ) sorted[k] = colourPatches[coff + perm[k]];
+            ierr = PetscMemcpy(colourPatches + coff, sorted, cdof*sizeof(PetscInt)); CHKERRQ(ierr);
+        }
+        ierr = PetscFree3(key, perm, sorted); CHKERRQ(ierr);
+    }
+    ierr = ISCreateGeneral(PETSC_COMM_SELF, ncoloured, colourPatches, PETSC_OWN_POINTER, &patch->colourPatches); CHKERRQ(ierr);
+    ierr = PetscFree(colourOffsets); CHKERRQ(ierr);
+    ierr = PetscFree(patchColour); CHKERRQ(ierr);
+    ierr = PetscFree(dofColour); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCReset_PATCH"
+static PetscErrorCode PCReset_PATCH(PC pc)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscInt        i;
+
+    PetscFunctionBegin;
+    ierr = DMDestroy(&patch->dm); CHKERRQ(ierr);
+    ierr = PetscSFDestroy(&patch->defaultSF); CHKERRQ(ierr);
+    ierr = PetscSectionDestroy(&patch->dofSection); CHKERRQ(ierr);
+    ierr = PetscSectionDestroy(&patch->cellCounts); CHKERRQ(ierr);
+    ierr = PetscSectionDestroy(&patch->cellNumbering); CHKERRQ(ierr);
+    ierr = PetscSectionDestroy(&patch->gtolCounts); CHKERRQ(ierr);
+    ierr = PetscSectionDestroy(&patch->bcCounts); CHKERRQ(ierr);
+    ierr = PetscSectionDestroy(&patch->colourCounts); CHKERRQ(ierr);
+    ierr = ISDestroy(&patch->colourPatches); CHKERRQ(ierr);
+    ierr = ISDestroy(&patch->gtol); CHKERRQ(ierr);
+    ierr = ISDestroy(&patch->cells); CHKERRQ(ierr);
+    ierr = ISDestroy(&patch->dofs); CHKERRQ(ierr);
+    ierr = ISDestroy(&patch->bcNodes); CHKERRQ(ierr);
+    if (patch->bcs) {
+        for ( i = 0; i < patch->npatch; i++ ) {
+            ierr = ISDestroy(&patch->bcs[i]); CHKERRQ(ierr);
+        }
+        ierr = PetscFree(patch->bcs); CHKERRQ(ierr);
+    }
+
+    if (patch->free_type) {
+        ierr = MPI_Type_free(&patch->data_type); CHKERRQ(ierr);
         patch->data_type = MPI_DATATYPE_NULL; 
     }
 
     if (patch->ksp) {
         for ( i = 0; i < patch->npatch; i++ ) {
+            if (!patch->ksp[i]) continue;
             ierr = KSPReset(patch->ksp[i]); CHKERRQ(ierr);
         }
     }
+    ierr = PetscFree(patch->denseOffsets); CHKERRQ(ierr);
+    ierr = PetscFree(patch->denseFactors); CHKERRQ(ierr);
+    ierr = PetscFree(patch->denseFactorsSingle); CHKERRQ(ierr);
+    ierr = PetscFree(patch->denseScratch); CHKERRQ(ierr);
+    patch->denseMaxDof = 0;
+    ierr = PetscFree(patch->densePivots); CHKERRQ(ierr);
+    ierr = PetscFree(patch->denseShared); CHKERRQ(ierr);
+    ierr = PetscFree(patch->fdmDims); CHKERRQ(ierr);
+    ierr = PetscFree(patch->fdmIdx); CHKERRQ(ierr);
+    ierr = PetscFree(patch->fdmOffsets); CHKERRQ(ierr);
+    ierr = PetscFree(patch->fdmData); CHKERRQ(ierr);
+    ierr = PetscFree(patch->fdmWork); CHKERRQ(ierr);
+    patch->nfdm = 0;
+    ierr = PetscFree(patch->densePerms); CHKERRQ(ierr);
+    patch->nuniqueFactors = 0;
 
     ierr = VecDestroy(&patch->localX); CHKERRQ(ierr);
     ierr = VecDestroy(&patch->localY); CHKERRQ(ierr);
@@ -710,13 +1845,50 @@ static PetscErrorCode PCReset_PATCH(PC pc)
         }
         ierr = PetscFree(patch->patchY); CHKERRQ(ierr);
     }
+    ierr = PetscFree2(patch->patchXArray, patch->patchYArray); CHKERRQ(ierr);
+    ierr = PetscFree(patch->gatherIdx); CHKERRQ(ierr);
+    ierr = PetscFree(patch->interior); CHKERRQ(ierr);
+    ierr = PetscFree(patch->ownedIdx); CHKERRQ(ierr);
+    ierr = PetscFree(patch->scatterIdx); CHKERRQ(ierr);
+    ierr = PetscFree(patch->ownedScatterIdx); CHKERRQ(ierr);
+    ierr = VecDestroy(&patch->dof_weights); CHKERRQ(ierr);
+    patch->ninterior = 0;
     if (patch->mat) {
         for ( i = 0; i < patch->npatch; i++ ) {
             ierr = MatDestroy(patch->mat + i); CHKERRQ(ierr);
         }
         ierr = PetscFree(patch->mat); CHKERRQ(ierr);
     }
+    if (patch->matWithBcs) {
+        for ( i = 0; i < patch->npatch; i++ ) {
+            ierr = MatDestroy(patch->matWithBcs + i); CHKERRQ(ierr);
+        }
+        ierr = PetscFree(patch->matWithBcs); CHKERRQ(ierr);
+    }
     ierr = PetscFree(patch->sub_mat_type); CHKERRQ(ierr);
+    ierr = PetscFree(patch->elementSlots); CHKERRQ(ierr);
+    ierr = PetscFree(patch->elementCells); CHKERRQ(ierr);
+    ierr = PetscFree(patch->elementMats); CHKERRQ(ierr);
+    patch->nelementSlots = 0;
+    ierr = PetscFree(patch->cellInterior); CHKERRQ(ierr);
+    ierr = PetscFree(patch->condenseIdx); CHKERRQ(ierr);
+    ierr = PetscFree(patch->condenseData); CHKERRQ(ierr);
+    ierr = PetscFree(patch->condenseWork); CHKERRQ(ierr);
+    patch->ncellInterior = 0;
+    ierr = PetscFree(patch->dirtyCells); CHKERRQ(ierr);
+    ierr = PetscFree(patch->cellDirty); CHKERRQ(ierr);
+    ierr = PetscFree(patch->patchDirty); CHKERRQ(ierr);
+    patch->ndirtyCells  = 0;
+    patch->dirtyMarked  = PETSC_FALSE;
+    patch->ncellNumbers = 0;
+    ierr = PetscFree4(patch->lruCached, patch->lruPrev, patch->lruNext, patch->lruBytes); CHKERRQ(ierr);
+    patch->lruTotal = 0;
+    patch->ncached  = 0;
+    ierr = PetscFree2(patch->nnz, patch->nnzUpper); CHKERRQ(ierr);
+    ierr = PetscFree(patch->patchOrder); CHKERRQ(ierr);
+    ierr = PetscFree(patch->patchVertices); CHKERRQ(ierr);
+    ierr = PetscFree(patch->truncated); CHKERRQ(ierr);
+    ierr = PetscFree(patch->patchCost); CHKERRQ(ierr);
 
     patch->free_type = PETSC_FALSE;
     patch->bs = 0;
@@ -735,126 +1907,2032 @@ static PetscErrorCode PCDestroy_PATCH(PC pc)
     PetscFunctionBegin;
 
     ierr = PCReset_PATCH(pc); CHKERRQ(ierr);
+    ierr = PetscFree(patch->dofCoords); CHKERRQ(ierr);
+    /* Like the compute operator callback, the kernel outlives PCReset. */
+    ierr = PetscFree(patch->kernelargs); CHKERRQ(ierr);
     if (patch->ksp) {
         for ( i = 0; i < patch->npatch; i++ ) {
             ierr = KSPDestroy(&patch->ksp[i]); CHKERRQ(ierr);
         }
-        ierr = PetscFree(patch->ksp); CHKERRQ(ierr);
+        ierr = PetscFree(patch->ksp); CHKERRQ(ierr);
+    }
+    ierr = PetscFree(pc->data); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchClassifyPatches"
+/*
+ * PCPatchClassifyPatches - Find the interior patches, those whose
+ * dofs are all owned by this process.
+ *
+ * Output Parameters:
+ * + interior - Flag for each patch
+ * - ownedIdx - For interior patches, the gather table translated to
+ *              indices into the owned part of the global vectors
+ *
+ * Note:
+ *  Interior patches need no halo exchange, so they can read the
+ *  global right hand side and add into the global solution directly
+ *  while the communication for the other patches is in flight.
+ */
+static PetscErrorCode PCPatchClassifyPatches(PC pc)
+{
+    PetscErrorCode     ierr;
+    PC_PATCH          *patch = (PC_PATCH *)pc->data;
+    const PetscInt     bs    = patch->bs;
+    const PetscInt    *ilocal;
+    const PetscSFNode *iremote;
+    const PetscInt    *gtolArray;
+    PetscInt          *owned = NULL;
+    PetscInt           nroots, nleaves, nlocal, pStart, pEnd, numDofs;
+    PetscMPIInt        rank;
+
+    PetscFunctionBegin;
+    ierr = MPI_Comm_rank(PetscObjectComm((PetscObject)patch->defaultSF), &rank); CHKERRQ(ierr);
+    ierr = PetscSFGetGraph(patch->defaultSF, &nroots, &nleaves, &ilocal, &iremote); CHKERRQ(ierr);
+    ierr = PetscSectionGetStorageSize(patch->dofSection, &nlocal); CHKERRQ(ierr);
+    /* Map each local node to the owned node it is a copy of, or -1
+     * if it's a ghost. */
+    ierr = PetscMalloc1(nlocal, &owned); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < nlocal; i++ ) owned[i] = -1;
+    for ( PetscInt k = 0; k < nleaves; k++ ) {
+        const PetscInt leaf = ilocal ? ilocal[k] : k;
+        if (iremote[k].rank == rank && leaf < nlocal) owned[leaf] = iremote[k].index;
+    }
+
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, &pEnd); CHKERRQ(ierr);
+    ierr = PetscSectionGetStorageSize(patch->gtolCounts, &numDofs); CHKERRQ(ierr);
+    ierr = PetscMalloc1(patch->npatch, &patch->interior); CHKERRQ(ierr);
+    ierr = PetscMalloc1(numDofs*bs, &patch->ownedIdx); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->gtol, &gtolArray); CHKERRQ(ierr);
+    patch->ninterior = 0;
+    for ( PetscInt p = pStart; p < pEnd; p++ ) {
+        PetscInt dof, off;
+        PetscBool interior = PETSC_TRUE;
+        ierr = PetscSectionGetDof(patch->gtolCounts, p, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->gtolCounts, p, &off); CHKERRQ(ierr);
+        for ( PetscInt i = off; i < off + dof; i++ ) {
+            if (owned[gtolArray[i]] < 0) {
+                interior = PETSC_FALSE;
+                break;
+            }
+        }
+        patch->interior[p - pStart] = interior;
+        if (!interior) continue;
+        patch->ninterior++;
+        for ( PetscInt i = off; i < off + dof; i++ ) {
+            for ( PetscInt j = 0; j < bs; j++ ) {
+                const PetscInt idx = owned[gtolArray[i]]*bs + j;
+                /* Keep the BC marking of the local table. */
+                patch->ownedIdx[i*bs + j] = patch->gatherIdx[i*bs + j] >= 0 ? idx : -(idx + 1);
+            }
+        }
+    }
+    ierr = ISRestoreIndices(patch->gtol, &gtolArray); CHKERRQ(ierr);
+    ierr = PetscFree(owned); CHKERRQ(ierr);
+    ierr = PetscInfo2(pc, "%D of %D patches are interior\n", patch->ninterior, patch->npatch); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCreateRestriction"
+/*
+ * PCPatchCreateRestriction - Give every dof one owning patch, for
+ * restricted additive Schwarz.
+ *
+ * Output Parameters:
+ * + scatterIdx - The gather table, with the entries each patch doesn't
+ *                own marked as patch BCs are
+ * - ownedScatterIdx - Likewise for ownedIdx (interior patches)
+ *
+ * Note:
+ *  On a process, a dof belongs to the first patch it is free in, in
+ *  the order the patches are applied.  Across processes, the process
+ *  owning the dof wins if it has such a patch, otherwise the highest
+ *  ranked one that does.  Patches then only add their owned entries
+ *  into the solution.
+ */
+static PetscErrorCode PCPatchCreateRestriction(PC pc)
+{
+    PetscErrorCode     ierr;
+    PC_PATCH          *patch  = (PC_PATCH *)pc->data;
+    const PetscInt     bs     = patch->bs;
+    const PetscInt    *ilocal;
+    const PetscSFNode *iremote;
+    const PetscInt    *gtolArray;
+    PetscInt          *winner = NULL, *claim = NULL, *best = NULL, *rootClaim = NULL;
+    PetscInt           nroots, nleaves, nlocal, numDofs;
+    PetscMPIInt        rank, size;
+
+    PetscFunctionBegin;
+    ierr = MPI_Comm_rank(PetscObjectComm((PetscObject)patch->defaultSF), &rank); CHKERRQ(ierr);
+    ierr = MPI_Comm_size(PetscObjectComm((PetscObject)patch->defaultSF), &size); CHKERRQ(ierr);
+    ierr = PetscSFGetGraph(patch->defaultSF, &nroots, &nleaves, &ilocal, &iremote); CHKERRQ(ierr);
+    ierr = PetscSectionGetStorageSize(patch->dofSection, &nlocal); CHKERRQ(ierr);
+    ierr = PetscSectionGetStorageSize(patch->gtolCounts, &numDofs); CHKERRQ(ierr);
+    ierr = PetscMalloc4(nlocal, &winner, nlocal, &claim, nlocal, &best, nroots, &rootClaim); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < nlocal; i++ ) winner[i] = -1;
+    ierr = ISGetIndices(patch->gtol, &gtolArray); CHKERRQ(ierr);
+    for ( PetscInt k = 0; k < patch->npatch; k++ ) {
+        const PetscInt i = patch->patchOrder ? patch->patchOrder[k] : k;
+        PetscInt       dof, off;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->gtolCounts, i, &off); CHKERRQ(ierr);
+        for ( PetscInt j = off; j < off + dof; j++ ) {
+            if (patch->gatherIdx[j*bs] < 0 || winner[gtolArray[j]] >= 0) continue;
+            winner[gtolArray[j]] = i;
+        }
+    }
+    /* Claims: size + 1 from the owner, rank + 1 from anyone else. */
+    for ( PetscInt i = 0; i < nlocal; i++ ) claim[i] = winner[i] >= 0 ? size + 1 : 0;
+    for ( PetscInt k = 0; k < nleaves; k++ ) {
+        const PetscInt leaf = ilocal ? ilocal[k] : k;
+        if (leaf < nlocal && winner[leaf] >= 0 && iremote[k].rank != rank) claim[leaf] = rank + 1;
+    }
+    for ( PetscInt i = 0; i < nroots; i++ ) rootClaim[i] = 0;
+    ierr = PetscSFReduceBegin(patch->defaultSF, MPIU_INT, claim, rootClaim, MPI_MAX); CHKERRQ(ierr);
+    ierr = PetscSFReduceEnd(patch->defaultSF, MPIU_INT, claim, rootClaim, MPI_MAX); CHKERRQ(ierr);
+    ierr = PetscMemcpy(best, claim, nlocal*sizeof(PetscInt)); CHKERRQ(ierr);
+    ierr = PetscSFBcastBegin(patch->defaultSF, MPIU_INT, rootClaim, best); CHKERRQ(ierr);
+    ierr = PetscSFBcastEnd(patch->defaultSF, MPIU_INT, rootClaim, best); CHKERRQ(ierr);
+
+    ierr = PetscMalloc1(numDofs*bs, &patch->scatterIdx); CHKERRQ(ierr);
+    if (patch->ownedIdx) {
+        ierr = PetscMalloc1(numDofs*bs, &patch->ownedScatterIdx); CHKERRQ(ierr);
+    }
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        PetscInt dof, off;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->gtolCounts, i, &off); CHKERRQ(ierr);
+        for ( PetscInt j = off; j < off + dof; j++ ) {
+            const PetscInt  d    = gtolArray[j];
+            const PetscBool mine = (winner[d] == i && claim[d] > 0 && claim[d] == best[d]) ? PETSC_TRUE : PETSC_FALSE;
+            for ( PetscInt l = j*bs; l < (j + 1)*bs; l++ ) {
+                const PetscInt g = patch->gatherIdx[l];
+                patch->scatterIdx[l] = (mine || g < 0) ? g : -(g + 1);
+                if (patch->ownedScatterIdx && patch->interior[i]) {
+                    const PetscInt o = patch->ownedIdx[l];
+                    patch->ownedScatterIdx[l] = (mine || o < 0) ? o : -(o + 1);
+                }
+            }
+        }
+    }
+    ierr = ISRestoreIndices(patch->gtol, &gtolArray); CHKERRQ(ierr);
+    ierr = PetscFree4(winner, claim, best, rootClaim); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCreatePreallocation"
+/*
+ * PCPatchCreatePreallocation - Count the nonzero blocks in each block
+ * row of every patch operator, from the cell dofs of the patch.
+ *
+ * Output Parameters:
+ * + nnz - Blocks in each row, offset by gtolCounts
+ * - nnzUpper - Blocks on and above the diagonal (for symmetric formats)
+ *
+ * Note:
+ *  For each patch the cells around each dof are listed, then the
+ *  distinct dofs of those cells counted with a stamp array.
+ */
+static PetscErrorCode PCPatchCreatePreallocation(PC pc)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    const PetscInt  npc   = patch->nodesPerCell;
+    const PetscInt *dofsArray;
+    PetscInt       *nodeCellOffsets = NULL, *nodeCells = NULL, *stamp = NULL;
+    PetscInt        pStart, pEnd, numDofs, maxDof = 0, maxCell = 0;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, &pEnd); CHKERRQ(ierr);
+    ierr = PetscSectionGetStorageSize(patch->gtolCounts, &numDofs); CHKERRQ(ierr);
+    ierr = PetscMalloc2(numDofs, &patch->nnz, numDofs, &patch->nnzUpper); CHKERRQ(ierr);
+    for ( PetscInt p = pStart; p < pEnd; p++ ) {
+        PetscInt dof, ncell;
+        ierr = PetscSectionGetDof(patch->gtolCounts, p, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetDof(patch->cellCounts, p, &ncell); CHKERRQ(ierr);
+        maxDof  = PetscMax(maxDof, dof);
+        maxCell = PetscMax(maxCell, ncell);
+    }
+    ierr = PetscMalloc3(maxDof + 1, &nodeCellOffsets, maxCell*npc, &nodeCells, maxDof, &stamp); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->dofs, &dofsArray); CHKERRQ(ierr);
+    for ( PetscInt p = pStart; p < pEnd; p++ ) {
+        PetscInt dof, off, ncell, cOff;
+        ierr = PetscSectionGetDof(patch->gtolCounts, p, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->gtolCounts, p, &off); CHKERRQ(ierr);
+        ierr = PetscSectionGetDof(patch->cellCounts, p, &ncell); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->cellCounts, p, &cOff); CHKERRQ(ierr);
+        /* Cells around each dof, as CSR. */
+        for ( PetscInt k = 0; k <= dof; k++ ) nodeCellOffsets[k] = 0;
+        for ( PetscInt c = 0; c < ncell; c++ ) {
+            for ( PetscInt a = 0; a < npc; a++ ) {
+                const PetscInt d = dofsArray[(cOff + c)*npc + a];
+                if (d >= 0) nodeCellOffsets[d + 1]++;
+            }
+        }
+        for ( PetscInt k = 0; k < dof; k++ ) nodeCellOffsets[k + 1] += nodeCellOffsets[k];
+        for ( PetscInt c = 0; c < ncell; c++ ) {
+            for ( PetscInt a = 0; a < npc; a++ ) {
+                const PetscInt d = dofsArray[(cOff + c)*npc + a];
+                if (d >= 0) nodeCells[nodeCellOffsets[d]++] = c;
+            }
+        }
+        /* Filling shifted the offsets along by one. */
+        for ( PetscInt k = dof; k > 0; k-- ) nodeCellOffsets[k] = nodeCellOffsets[k - 1];
+        nodeCellOffsets[0] = 0;
+        for ( PetscInt k = 0; k < dof; k++ ) stamp[k] = -1;
+        for ( PetscInt r = 0; r < dof; r++ ) {
+            PetscInt n = 0, nu = 0;
+            for ( PetscInt j = nodeCellOffsets[r]; j < nodeCellOffsets[r + 1]; j++ ) {
+                const PetscInt *cellDofs = dofsArray + (cOff + nodeCells[j])*npc;
+                for ( PetscInt a = 0; a < npc; a++ ) {
+                    const PetscInt col = cellDofs[a];
+                    if (col < 0 || stamp[col] == r) continue;
+                    stamp[col] = r;
+                    n++;
+                    if (col >= r) nu++;
+                }
+            }
+            patch->nnz[off + r]      = n;
+            patch->nnzUpper[off + r] = nu;
+        }
+    }
+    ierr = ISRestoreIndices(patch->dofs, &dofsArray); CHKERRQ(ierr);
+    ierr = PetscFree3(nodeCellOffsets, nodeCells, stamp); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCreateMatrix"
+static PetscErrorCode PCPatchCreateMatrix(PC pc, PetscInt which, Mat *mat)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscInt        pStart, size, off;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = PetscSectionGetDof(patch->gtolCounts, which + pStart, &size); CHKERRQ(ierr);
+    ierr = PetscSectionGetOffset(patch->gtolCounts, which + pStart, &off); CHKERRQ(ierr);
+    size *= patch->bs;
+    ierr = MatCreate(PETSC_COMM_SELF, mat); CHKERRQ(ierr);
+    if (patch->sub_mat_type) {
+        ierr = MatSetType(*mat, patch->sub_mat_type); CHKERRQ(ierr);
+    } else {
+        /* What MatSetUp would pick, but we want to preallocate it. */
+        ierr = MatSetType(*mat, MATAIJ); CHKERRQ(ierr);
+    }
+    ierr = MatSetSizes(*mat, size, size, size, size); CHKERRQ(ierr);
+    ierr = MatSetBlockSizes(*mat, patch->bs, patch->bs); CHKERRQ(ierr);
+    /* Exact, so assembly never mallocs.  Does nothing for formats
+     * that don't take preallocation. */
+    ierr = MatXAIJSetPreallocation(*mat, patch->bs, patch->nnz + off, NULL, patch->nnzUpper + off, NULL); CHKERRQ(ierr);
+    ierr = MatSetUp(*mat); CHKERRQ(ierr);
+
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCallKernel_Private"
+/*
+ * PCPatchCallKernel_Private - Call the compiled kernel on a set of cells.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . mat - Matrix to add into
+ * . ncell - Number of cells
+ * . cells - The cells (Firedrake numbering)
+ * - dofs - Patch local dofs of each cell (ncell*nodesPerCell)
+ */
+static PetscErrorCode PCPatchCallKernel_Private(PC pc, Mat mat, PetscInt ncell, const PetscInt *cells, const PetscInt *dofs)
+{
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    void          (*k)(void) = patch->kernel;
+    void          **a        = patch->kernelargs;
+
+    PetscFunctionBegin;
+    switch (patch->nkernelargs) {
+    case 0:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *))k)(0, (int)ncell, cells, mat, dofs, dofs);
+        break;
+    case 1:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0]);
+        break;
+    case 2:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1]);
+        break;
+    case 3:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2]);
+        break;
+    case 4:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3]);
+        break;
+    case 5:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3], a[4]);
+        break;
+    case 6:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3], a[4], a[5]);
+        break;
+    case 7:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+        break;
+    case 8:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+        break;
+    case 9:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *, void *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8]);
+        break;
+    case 10:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9]);
+        break;
+    case 11:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10]);
+        break;
+    case 12:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11]);
+        break;
+    case 13:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11], a[12]);
+        break;
+    case 14:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11], a[12], a[13]);
+        break;
+    case 15:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11], a[12], a[13], a[14]);
+        break;
+    case 16:
+        ((void (*)(int, int, const PetscInt *, Mat, const PetscInt *, const PetscInt *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *, void *))k)(0, (int)ncell, cells, mat, dofs, dofs, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9], a[10], a[11], a[12], a[13], a[14], a[15]);
+        break;
+    default:
+        SETERRQ1(PETSC_COMM_SELF, PETSC_ERR_ARG_OUTOFRANGE, "Unsupported number of kernel arguments %D\n", patch->nkernelargs);
+    }
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchComputeOperatorCells_Private"
+/*
+ * PCPatchComputeOperatorCells_Private - Assemble the operator over a
+ * set of cells with the kernel or user callback.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . mat - Matrix to add into, assumed zeroed
+ * . ncell - Number of cells
+ * . cells - The cells (Firedrake numbering)
+ * - dofs - Local dofs of each cell (ncell*nodesPerCell)
+ */
+static PetscErrorCode PCPatchComputeOperatorCells_Private(PC pc, Mat mat, PetscInt ncell, const PetscInt *cells, const PetscInt *dofs)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+
+    PetscFunctionBegin;
+    if (patch->kernel) {
+        /* No need to go through Python for every patch. */
+        ierr = PCPatchCallKernel_Private(pc, mat, ncell, cells, dofs); CHKERRQ(ierr);
+        ierr = MatAssemblyBegin(mat, MAT_FINAL_ASSEMBLY); CHKERRQ(ierr);
+        ierr = MatAssemblyEnd(mat, MAT_FINAL_ASSEMBLY); CHKERRQ(ierr);
+    } else {
+        PetscStackPush("PCPatch user callback");
+        ierr = patch->usercomputeop(pc, mat, ncell, cells, ncell*patch->nodesPerCell, dofs, patch->usercomputectx); CHKERRQ(ierr);
+        PetscStackPop;
+    }
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCreateElementCache"
+/*
+ * PCPatchCreateElementCache - Lay out storage for one element matrix
+ * per cell that appears in any patch.
+ *
+ * Output Parameters:
+ * + elementSlots - Map from (Firedrake) cell to slot in the cache, -1 if unused
+ * . elementCells - Map from slot to cell
+ * - elementMats - The cache
+ */
+static PetscErrorCode PCPatchCreateElementCache(PC pc)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    const PetscInt  size  = PetscSqr(patch->nodesPerCell*patch->bs);
+    const PetscInt *cellsArray;
+    PetscInt        numCells, maxCell = -1;
+
+    PetscFunctionBegin;
+    ierr = ISGetSize(patch->cells, &numCells); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < numCells; i++ ) {
+        maxCell = PetscMax(maxCell, cellsArray[i]);
+    }
+    ierr = PetscMalloc1(maxCell + 1, &patch->elementSlots); CHKERRQ(ierr);
+    for ( PetscInt c = 0; c <= maxCell; c++ ) patch->elementSlots[c] = -1;
+    patch->nelementSlots = 0;
+    for ( PetscInt i = 0; i < numCells; i++ ) {
+        if (patch->elementSlots[cellsArray[i]] < 0) {
+            patch->elementSlots[cellsArray[i]] = patch->nelementSlots++;
+        }
+    }
+    ierr = PetscMalloc1(patch->nelementSlots, &patch->elementCells); CHKERRQ(ierr);
+    for ( PetscInt c = 0; c <= maxCell; c++ ) {
+        if (patch->elementSlots[c] >= 0) patch->elementCells[patch->elementSlots[c]] = c;
+    }
+    ierr = ISRestoreIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    ierr = PetscMalloc1((size_t)patch->nelementSlots*size, &patch->elementMats); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCondenseElement_Private"
+/*
+ * PCPatchCondenseElement_Private - Statically condense an element
+ * matrix, eliminating its cell interior entries.
+ *
+ * Input Parameters:
+ * + n - Size of the element matrix
+ * . ni - Number of interior entries
+ * . idx - Cell local entries, the ni interior ones first
+ * . work - Work space, ni*ni
+ * - ipiv - Work space, ni
+ *
+ * Input/Output Parameters:
+ * . Ae - The element matrix, row major.  On exit the Schur complement
+ *        S = K_bb - K_bi K_ii^-1 K_ib, zero in the interior rows and
+ *        columns.
+ *
+ * Output Parameters:
+ * . data - K_ii^-1, K_ii^-1 K_ib and K_bi K_ii^-1, column major, to
+ *          condense right hand sides and recover interior solutions
+ */
+static PetscErrorCode PCPatchCondenseElement_Private(PetscInt n, PetscInt ni, const PetscInt *idx, PetscScalar *Ae,
+                                                     PetscScalar *data, PetscScalar *work, PetscBLASInt *ipiv)
+{
+    PetscErrorCode  ierr;
+    const PetscInt  nb    = n - ni;
+    const PetscInt *iIdx  = idx, *bIdx = idx + ni;
+    PetscScalar    *Kinv  = data, *E = data + ni*ni, *F = data + ni*ni + ni*nb;
+    PetscBLASInt    bni, bnb, info;
+
+    PetscFunctionBegin;
+    ierr = PetscBLASIntCast(ni, &bni); CHKERRQ(ierr);
+    ierr = PetscBLASIntCast(nb, &bnb); CHKERRQ(ierr);
+    for ( PetscInt s = 0; s < ni; s++ ) {
+        for ( PetscInt r = 0; r < ni; r++ ) {
+            work[s*ni + r] = Ae[iIdx[r]*n + iIdx[s]];
+            Kinv[s*ni + r] = r == s ? 1.0 : 0.0;
+        }
+    }
+    for ( PetscInt t = 0; t < nb; t++ ) {
+        for ( PetscInt r = 0; r < ni; r++ ) E[t*ni + r] = Ae[iIdx[r]*n + bIdx[t]];
+    }
+    PetscStackCallBLAS("LAPACKgetrf", LAPACKgetrf_(&bni, &bni, work, &bni, ipiv, &info));
+    if (info) {
+        SETERRQ1(PETSC_COMM_SELF, PETSC_ERR_LIB, "Error in LAPACK getrf on cell interior block, info %d\n", (int)info);
+    }
+    PetscStackCallBLAS("LAPACKgetrs", LAPACKgetrs_("N", &bni, &bni, work, &bni, ipiv, Kinv, &bni, &info));
+    PetscStackCallBLAS("LAPACKgetrs", LAPACKgetrs_("N", &bni, &bnb, work, &bni, ipiv, E, &bni, &info));
+    for ( PetscInt t = 0; t < nb; t++ ) {
+        const PetscScalar *Kbi = Ae + bIdx[t]*n;
+        for ( PetscInt r = 0; r < ni; r++ ) {
+            PetscScalar sum = 0;
+            for ( PetscInt s = 0; s < ni; s++ ) sum += Kbi[iIdx[s]]*Kinv[r*ni + s];
+            F[r*nb + t] = sum;
+        }
+        for ( PetscInt u = 0; u < nb; u++ ) {
+            PetscScalar sum = 0;
+            for ( PetscInt s = 0; s < ni; s++ ) sum += Kbi[iIdx[s]]*E[u*ni + s];
+            Ae[bIdx[t]*n + bIdx[u]] -= sum;
+        }
+    }
+    for ( PetscInt r = 0; r < ni; r++ ) {
+        for ( PetscInt k = 0; k < n; k++ ) {
+            Ae[iIdx[r]*n + k] = 0;
+            Ae[k*n + iIdx[r]] = 0;
+        }
+    }
+    ierr = PetscLogFlops((2.0*ni*ni*ni)/3.0 + 2.0*ni*ni*(ni + nb) + 2.0*nb*ni*(ni + nb)); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchComputeElementMatrices"
+/*
+ * PCPatchComputeElementMatrices - Compute the element matrix of every
+ * cached cell, once.
+ *
+ * Note:
+ *  Element matrices are stored row major, ready for MatSetValuesBlocked.
+ *  When condensing, the cache holds the condensed element matrices.
+ *  After the first PCSetUp, only cells marked dirty are recomputed,
+ *  unless detecting changes: then all are, and those whose matrix
+ *  differs are marked.
+ */
+static PetscErrorCode PCPatchComputeElementMatrices(PC pc)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    const PetscInt  npc   = patch->nodesPerCell;
+    const PetscInt  n     = npc*patch->bs;
+    const PetscInt  ni    = patch->ncellInterior*patch->bs;
+    const PetscInt  csize = ni*ni + 2*ni*(n - ni);
+    const PetscBool skip  = (pc->setupcalled && patch->dirtyMarked && !patch->detect_changes) ? PETSC_TRUE : PETSC_FALSE;
+    const PetscBool check = (pc->setupcalled && patch->detect_changes) ? PETSC_TRUE : PETSC_FALSE;
+    PetscScalar    *work  = NULL;
+    PetscScalar    *old   = NULL;
+    PetscBLASInt   *ipiv  = NULL;
+    PetscInt       *identity;
+    Mat             mat;
+
+    PetscFunctionBegin;
+    ierr = PetscLogEventBegin(PC_Patch_ComputeOp, pc, 0, 0, 0); CHKERRQ(ierr);
+    if (patch->cellInterior) {
+        if (!patch->condenseData) {
+            ierr = PetscMalloc1((size_t)patch->nelementSlots*csize, &patch->condenseData); CHKERRQ(ierr);
+            ierr = PetscMalloc1(n, &patch->condenseWork); CHKERRQ(ierr);
+        }
+        ierr = PetscMalloc2(ni*ni, &work, ni, &ipiv); CHKERRQ(ierr);
+    }
+    if (!patch->usercomputeop && !patch->kernel) {
+        SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_WRONGSTATE, "Must call PCPatchSetComputeOperator() to set user callback\n");
+    }
+    ierr = PetscMalloc1(npc, &identity); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < npc; i++ ) identity[i] = i;
+    ierr = MatCreate(PETSC_COMM_SELF, &mat); CHKERRQ(ierr);
+    ierr = MatSetSizes(mat, n, n, n, n); CHKERRQ(ierr);
+    ierr = MatSetBlockSizes(mat, patch->bs, patch->bs); CHKERRQ(ierr);
+    ierr = MatSetType(mat, MATSEQDENSE); CHKERRQ(ierr);
+    ierr = MatSeqDenseSetPreallocation(mat, NULL); CHKERRQ(ierr);
+    if (check) {
+        ierr = PetscMalloc1(n*n, &old); CHKERRQ(ierr);
+    }
+    for ( PetscInt slot = 0; slot < patch->nelementSlots; slot++ ) {
+        PetscScalar       *elementMat = patch->elementMats + (size_t)slot*n*n;
+        const PetscInt     cell       = patch->elementCells[slot];
+        const PetscScalar *values;
+        if (skip && !patch->cellDirty[cell]) continue;
+        if (check) {
+            ierr = PetscMemcpy(old, elementMat, n*n*sizeof(PetscScalar)); CHKERRQ(ierr);
+        }
+        ierr = MatZeroEntries(mat); CHKERRQ(ierr);
+        ierr = PCPatchComputeOperatorCells_Private(pc, mat, 1, patch->elementCells + slot, identity); CHKERRQ(ierr);
+        /* Dense storage is column major, transpose into the cache. */
+        ierr = MatDenseGetArray(mat, (PetscScalar **)&values); CHKERRQ(ierr);
+        for ( PetscInt i = 0; i < n; i++ ) {
+            for ( PetscInt j = 0; j < n; j++ ) {
+                elementMat[i*n + j] = values[j*n + i];
+            }
+        }
+        ierr = MatDenseRestoreArray(mat, (PetscScalar **)&values); CHKERRQ(ierr);
+        if (patch->cellInterior) {
+            ierr = PCPatchCondenseElement_Private(n, ni, patch->condenseIdx, elementMat,
+                                                  patch->condenseData + (size_t)slot*csize, work, ipiv); CHKERRQ(ierr);
+        }
+        if (check) {
+            /* Kernels are deterministic, so unchanged inputs give
+             * identical matrices. */
+            for ( PetscInt k = 0; k < n*n; k++ ) {
+                if (old[k] != elementMat[k]) {
+                    patch->cellDirty[cell] = PETSC_TRUE;
+                    break;
+                }
+            }
+        }
+    }
+    ierr = MatDestroy(&mat); CHKERRQ(ierr);
+    ierr = PetscFree(identity); CHKERRQ(ierr);
+    ierr = PetscFree2(work, ipiv); CHKERRQ(ierr);
+    ierr = PetscFree(old); CHKERRQ(ierr);
+    ierr = PetscLogEventEnd(PC_Patch_ComputeOp, pc, 0, 0, 0); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchComputeOperator"
+/*
+ * PCPatchComputeOperator - Assemble the operator on a patch.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . mat - Patch sized matrix, assumed zeroed
+ * . which - Index of the patch
+ * - applyBcs - Apply patch boundary conditions?  If not, the
+ *   boundary rows and columns of the operator are kept (needed for
+ *   residual updates).
+ */
+static PetscErrorCode PCPatchComputeOperator(PC pc, Mat mat, PetscInt which, PetscBool applyBcs)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    const PetscInt *dofsArray;
+    const PetscInt *cellsArray;
+    PetscInt        ncell, offset, pStart, pEnd;
+
+    PetscFunctionBegin;
+
+    ierr = PetscLogEventBegin(PC_Patch_ComputeOp, pc, 0, 0, 0); CHKERRQ(ierr);
+    if (!patch->usercomputeop && !patch->kernel) {
+        SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_WRONGSTATE, "Must call PCPatchSetComputeOperator() to set user callback\n");
+    }
+    ierr = ISGetIndices(patch->dofs, &dofsArray); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    ierr = PetscSectionGetChart(patch->cellCounts, &pStart, &pEnd); CHKERRQ(ierr);
+
+    which += pStart;
+    if (which >= pEnd) {
+        SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_OUTOFRANGE, "Asked for operator index is invalid\n"); CHKERRQ(ierr);
+    }
+
+    ierr = PetscSectionGetDof(patch->cellCounts, which, &ncell); CHKERRQ(ierr);
+    ierr = PetscSectionGetOffset(patch->cellCounts, which, &offset); CHKERRQ(ierr);
+    if (patch->elementMats) {
+        /* Gather the cached element matrices. */
+        const PetscInt npc  = patch->nodesPerCell;
+        const PetscInt size = npc*patch->bs*npc*patch->bs;
+        for ( PetscInt i = offset; i < offset + ncell; i++ ) {
+            const PetscInt slot = patch->elementSlots[cellsArray[i]];
+            ierr = MatSetValuesBlocked(mat, npc, dofsArray + i*npc, npc, dofsArray + i*npc,
+                                       patch->elementMats + (size_t)slot*size, ADD_VALUES); CHKERRQ(ierr);
+        }
+        ierr = MatAssemblyBegin(mat, MAT_FINAL_ASSEMBLY); CHKERRQ(ierr);
+        ierr = MatAssemblyEnd(mat, MAT_FINAL_ASSEMBLY); CHKERRQ(ierr);
+    } else {
+        ierr = PCPatchComputeOperatorCells_Private(pc, mat, ncell, cellsArray + offset, dofsArray + offset*patch->nodesPerCell); CHKERRQ(ierr);
+    }
+    ierr = ISRestoreIndices(patch->dofs, &dofsArray); CHKERRQ(ierr);
+    ierr = ISRestoreIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    /* Apply boundary conditions.  Could also do this through the local_to_patch guy. */
+    if (applyBcs) {
+        PetscInt numBcs;
+        ierr = PetscSectionGetDof(patch->bcCounts, which, &numBcs); CHKERRQ(ierr);
+        /* Nothing to do if they were left out of the numbering. */
+        if (numBcs) {
+            ierr = MatZeroRowsColumnsIS(mat, patch->bcs[which-pStart], (PetscScalar)1.0, NULL, NULL); CHKERRQ(ierr);
+        }
+    }
+    ierr = PetscLogEventEnd(PC_Patch_ComputeOp, pc, 0, 0, 0); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+typedef struct {
+    PC        pc;
+    PetscInt  which;    /* Index of the patch */
+    PetscBool applyBcs; /* Identity on the patch BCs, as PCPatchComputeOperator? */
+} PCPatchShellCtx;
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchShellApply_Private"
+/*
+ * PCPatchShellApply_Private - Apply a patch operator, or extract its
+ * diagonal, cell by cell from the cached element matrices.
+ *
+ * Input Parameters:
+ * + A - The MATSHELL
+ * - x - Vector to apply to, NULL for the diagonal
+ *
+ * Output Parameters:
+ * . y - Result
+ */
+static PetscErrorCode PCPatchShellApply_Private(Mat A, Vec x, Vec y)
+{
+    PetscErrorCode     ierr;
+    PCPatchShellCtx   *ctx;
+    PC_PATCH          *patch;
+    const PetscScalar *xArray = NULL;
+    PetscScalar       *yArray;
+    const PetscInt    *dofsArray, *cellsArray, *bc;
+    PetscInt           bs, npc, ne, ncell, cOff, gOff, pStart, n;
+
+    PetscFunctionBegin;
+    ierr = MatShellGetContext(A, &ctx); CHKERRQ(ierr);
+    patch = (PC_PATCH *)ctx->pc->data;
+    bs    = patch->bs;
+    npc   = patch->nodesPerCell;
+    ne    = npc*bs;
+    ierr = PetscLogEventBegin(PC_Patch_ComputeOp, ctx->pc, 0, 0, 0); CHKERRQ(ierr);
+    ierr = PetscSectionGetChart(patch->cellCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = PetscSectionGetDof(patch->cellCounts, ctx->which + pStart, &ncell); CHKERRQ(ierr);
+    ierr = PetscSectionGetOffset(patch->cellCounts, ctx->which + pStart, &cOff); CHKERRQ(ierr);
+    ierr = PetscSectionGetDof(patch->gtolCounts, ctx->which + pStart, &n); CHKERRQ(ierr);
+    ierr = PetscSectionGetOffset(patch->gtolCounts, ctx->which + pStart, &gOff); CHKERRQ(ierr);
+    n *= bs;
+    /* Patch BC entries are the negative ones in the gather table. */
+    bc = patch->gatherIdx + gOff*bs;
+
+    ierr = ISGetIndices(patch->dofs, &dofsArray); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    if (x) {
+        ierr = VecGetArrayRead(x, &xArray); CHKERRQ(ierr);
+    }
+    ierr = VecGetArray(y, &yArray); CHKERRQ(ierr);
+    for ( PetscInt k = 0; k < n; k++ ) yArray[k] = 0;
+    for ( PetscInt c = cOff; c < cOff + ncell; c++ ) {
+        const PetscInt    *cellDofs = dofsArray + c*npc;
+        const PetscScalar *Ae       = patch->elementMats + (size_t)patch->elementSlots[cellsArray[c]]*ne*ne;
+        for ( PetscInt a = 0; a < npc; a++ ) {
+            /* Condensed out of the patch. */
+            if (cellDofs[a] < 0) continue;
+            for ( PetscInt j = 0; j < bs; j++ ) {
+                const PetscInt r   = a*bs + j;
+                const PetscInt row = cellDofs[a]*bs + j;
+                PetscScalar    sum = 0;
+                if (ctx->applyBcs && bc[row] < 0) continue;
+                if (!xArray) {
+                    yArray[row] += Ae[r*ne + r];
+                    continue;
+                }
+                for ( PetscInt b = 0; b < npc; b++ ) {
+                    if (cellDofs[b] < 0) continue;
+                    for ( PetscInt l = 0; l < bs; l++ ) {
+                        const PetscInt col = cellDofs[b]*bs + l;
+                        if (ctx->applyBcs && bc[col] < 0) continue;
+                        sum += Ae[r*ne + b*bs + l]*xArray[col];
+                    }
+                }
+                yArray[row] += sum;
+            }
+        }
+    }
+    if (ctx->applyBcs) {
+        /* Identity on the boundary, as MatZeroRowsColumns. */
+        for ( PetscInt k = 0; k < n; k++ ) {
+            if (bc[k] < 0) yArray[k] = xArray ? xArray[k] : 1.0;
+        }
+    }
+    ierr = VecRestoreArray(y, &yArray); CHKERRQ(ierr);
+    if (x) {
+        ierr = VecRestoreArrayRead(x, &xArray); CHKERRQ(ierr);
+    }
+    ierr = ISRestoreIndices(patch->dofs, &dofsArray); CHKERRQ(ierr);
+    ierr = ISRestoreIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    ierr = PetscLogFlops(2.0*ncell*npc*bs*npc*bs); CHKERRQ(ierr);
+    ierr = PetscLogEventEnd(PC_Patch_ComputeOp, ctx->pc, 0, 0, 0); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchShellMult_Private"
+static PetscErrorCode PCPatchShellMult_Private(Mat A, Vec x, Vec y)
+{
+    PetscErrorCode ierr;
+
+    PetscFunctionBegin;
+    ierr = PCPatchShellApply_Private(A, x, y); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchShellGetDiagonal_Private"
+static PetscErrorCode PCPatchShellGetDiagonal_Private(Mat A, Vec d)
+{
+    PetscErrorCode ierr;
+
+    PetscFunctionBegin;
+    ierr = PCPatchShellApply_Private(A, NULL, d); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchShellDestroy_Private"
+static PetscErrorCode PCPatchShellDestroy_Private(Mat A)
+{
+    PetscErrorCode   ierr;
+    PCPatchShellCtx *ctx;
+
+    PetscFunctionBegin;
+    ierr = MatShellGetContext(A, &ctx); CHKERRQ(ierr);
+    ierr = PetscFree(ctx); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCreateOperator_Private"
+/*
+ * PCPatchCreateOperator_Private - Create the operator of a KSP patch:
+ * an empty matrix to assemble into, or a matrix-free one.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . which - Index of the patch
+ * - applyBcs - Should a matrix-free operator apply the patch BCs?
+ *
+ * Output Parameters:
+ * . mat - The operator
+ *
+ * Note:
+ *  Matrix-free operators need no further assembly: they read the
+ *  cached element matrices, computed once per PCSetUp, on every
+ *  application.
+ */
+static PetscErrorCode PCPatchCreateOperator_Private(PC pc, PetscInt which, PetscBool applyBcs, Mat *mat)
+{
+    PetscErrorCode   ierr;
+    PC_PATCH        *patch = (PC_PATCH *)pc->data;
+    PCPatchShellCtx *ctx;
+    PetscInt         pStart, size;
+
+    PetscFunctionBegin;
+    if (!patch->matrix_free) {
+        ierr = PCPatchCreateMatrix(pc, which, mat); CHKERRQ(ierr);
+        PetscFunctionReturn(0);
+    }
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = PetscSectionGetDof(patch->gtolCounts, which + pStart, &size); CHKERRQ(ierr);
+    size *= patch->bs;
+    ierr = PetscNew(&ctx); CHKERRQ(ierr);
+    ctx->pc       = pc;
+    ctx->which    = which;
+    ctx->applyBcs = applyBcs;
+    ierr = MatCreateShell(PETSC_COMM_SELF, size, size, size, size, ctx, mat); CHKERRQ(ierr);
+    ierr = MatSetBlockSizes(*mat, patch->bs, patch->bs); CHKERRQ(ierr);
+    ierr = MatShellSetOperation(*mat, MATOP_MULT, (void (*)(void))PCPatchShellMult_Private); CHKERRQ(ierr);
+    ierr = MatShellSetOperation(*mat, MATOP_GET_DIAGONAL, (void (*)(void))PCPatchShellGetDiagonal_Private); CHKERRQ(ierr);
+    ierr = MatShellSetOperation(*mat, MATOP_DESTROY, (void (*)(void))PCPatchShellDestroy_Private); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchGetOperator_Private"
+/*
+ * PCPatchGetOperator_Private - Create and compute the operator of a
+ * KSP patch, for when operators aren't saved.
+ */
+static PetscErrorCode PCPatchGetOperator_Private(PC pc, PetscInt which, PetscBool applyBcs, Mat *mat)
+{
+    PetscErrorCode   ierr;
+    PC_PATCH        *patch = (PC_PATCH *)pc->data;
+
+    PetscFunctionBegin;
+    ierr = PCPatchCreateOperator_Private(pc, which, applyBcs, mat); CHKERRQ(ierr);
+    if (!patch->matrix_free) {
+        ierr = PCPatchComputeOperator(pc, *mat, which, applyBcs); CHKERRQ(ierr);
+    }
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchAssembleDense_Private"
+/*
+ * PCPatchAssembleDense_Private - Assemble a patch operator (with patch
+ * BCs) into caller provided dense storage.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . which - Index of the patch
+ * - A - Storage for the operator, column major
+ */
+static PetscErrorCode PCPatchAssembleDense_Private(PC pc, PetscInt which, PetscScalar *A)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscInt        pStart, n;
+    Mat             mat;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = PetscSectionGetDof(patch->gtolCounts, which + pStart, &n); CHKERRQ(ierr);
+    n *= patch->bs;
+    /* Wrap the storage so the user callback assembles straight
+     * into it (column major, as LAPACK wants). */
+    ierr = MatCreate(PETSC_COMM_SELF, &mat); CHKERRQ(ierr);
+    ierr = MatSetSizes(mat, n, n, n, n); CHKERRQ(ierr);
+    ierr = MatSetBlockSizes(mat, patch->bs, patch->bs); CHKERRQ(ierr);
+    ierr = MatSetType(mat, MATSEQDENSE); CHKERRQ(ierr);
+    ierr = MatSeqDenseSetPreallocation(mat, A); CHKERRQ(ierr);
+    ierr = MatZeroEntries(mat); CHKERRQ(ierr);
+    ierr = PCPatchComputeOperator(pc, mat, which, PETSC_TRUE); CHKERRQ(ierr);
+    /* Does not free A, the caller owns it. */
+    ierr = MatDestroy(&mat); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchFactorDense_Private"
+/*
+ * PCPatchFactorDense_Private - Assemble a patch operator directly into
+ * its slot in the dense factor arena and LU factor it in place.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * - which - Index of the patch (must have been assigned a dense slot)
+ *
+ * Note:
+ *  With single precision factors, the patch is assembled and factored
+ *  in denseScratch instead, then rounded into its slot.
+ */
+static PetscErrorCode PCPatchFactorDense_Private(PC pc, PetscInt which)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscScalar    *A     = patch->denseFactorsSingle ? patch->denseScratch : patch->denseFactors + patch->denseOffsets[which];
+    PetscBLASInt   *ipiv;
+    PetscBLASInt    n, info;
+    PetscInt        pStart, dof, off;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = PetscSectionGetDof(patch->gtolCounts, which + pStart, &dof); CHKERRQ(ierr);
+    ierr = PetscSectionGetOffset(patch->gtolCounts, which + pStart, &off); CHKERRQ(ierr);
+    ierr = PetscBLASIntCast(dof*patch->bs, &n); CHKERRQ(ierr);
+    ipiv = patch->densePivots + off*patch->bs;
+
+    ierr = PCPatchAssembleDense_Private(pc, which, A); CHKERRQ(ierr);
+    if (n > 0) {
+        PetscStackCallBLAS("LAPACKgetrf", LAPACKgetrf_(&n, &n, A, &n, ipiv, &info));
+        if (info) {
+            SETERRQ2(PETSC_COMM_SELF, PETSC_ERR_LIB, "Error in LAPACK getrf on patch %D, info %d\n", which, (int)info);
+        }
+        ierr = PetscLogFlops((2.0*n*n*n)/3.0); CHKERRQ(ierr);
+    }
+    if (patch->denseFactorsSingle) {
+        float *S = patch->denseFactorsSingle + patch->denseOffsets[which];
+        for ( PetscInt k = 0; k < n*n; k++ ) S[k] = (float)PetscRealPart(A[k]);
+    }
+    PetscFunctionReturn(0);
+}
+
+/* Combine a value into a running hash. */
+PETSC_STATIC_INLINE PetscInt64 PCPatchHashCombine_Private(PetscInt64 h, PetscInt64 v)
+{
+    unsigned long long x = (unsigned long long)h;
+    x ^= (unsigned long long)v + 0x9e3779b97f4a7c15ULL + (x << 6) + (x >> 2);
+    return (PetscInt64)x;
+}
+
+/* Round a matrix entry, relative to the largest one, for hashing. */
+PETSC_STATIC_INLINE PetscInt64 PCPatchHashValue_Private(PetscScalar a, PetscReal scale)
+{
+    const PetscReal re = PetscRealPart(a)/scale*1.e10;
+    const PetscReal im = PetscImaginaryPart(a)/scale*1.e10;
+    return PCPatchHashCombine_Private((PetscInt64)PetscFloorReal(re + 0.5), (PetscInt64)PetscFloorReal(im + 0.5));
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchRefineColours_Private"
+/*
+ * PCPatchRefineColours_Private - Refine dof colours by the (multiset
+ * of) entries of each row and colours of their columns, until the
+ * number of colours stops growing.
+ *
+ * Output Parameters:
+ * + colour - The refined colours
+ * . sorted - The colours, sorted
+ * - nclass - Number of distinct colours
+ */
+static PetscErrorCode PCPatchRefineColours_Private(PetscInt n, const PetscScalar *A, PetscReal scale,
+                                                   PetscInt *colour, PetscInt *next, PetscInt *sorted, PetscInt *nclass)
+{
+    PetscErrorCode ierr;
+    PetscInt       old = -1, count = 0;
+
+    PetscFunctionBegin;
+    for ( PetscInt round = 0; round <= n; round++ ) {
+        ierr = PetscMemcpy(sorted, colour, n*sizeof(PetscInt)); CHKERRQ(ierr);
+        ierr = PetscSortInt(n, sorted); CHKERRQ(ierr);
+        count = n > 0 ? 1 : 0;
+        for ( PetscInt a = 1; a < n; a++ ) {
+            if (sorted[a] != sorted[a - 1]) count++;
+        }
+        if (count == old || count == n) break;
+        old = count;
+        for ( PetscInt a = 0; a < n; a++ ) {
+            /* A sum, so that the order of the row doesn't matter. */
+            unsigned long long row = 0;
+            for ( PetscInt b = 0; b < n; b++ ) {
+                if (A[b*n + a] == (PetscScalar)0.0) continue;
+                row += (unsigned long long)PCPatchHashCombine_Private(PCPatchHashValue_Private(A[b*n + a], scale), colour[b]);
+            }
+            next[a] = (PetscInt)(PCPatchHashCombine_Private(colour[a], (PetscInt64)row) & PETSC_MAX_INT);
+        }
+        ierr = PetscMemcpy(colour, next, n*sizeof(PetscInt)); CHKERRQ(ierr);
+    }
+    *nclass = count;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCanonicalOrdering_Private"
+/*
+ * PCPatchCanonicalOrdering_Private - Order the dofs of a patch operator
+ * independently of their original numbering.
+ *
+ * Input Parameters:
+ * + n - Size of the operator
+ * . A - The operator, column major
+ * . scale - Largest entry of A in absolute value
+ * - work - Work space, 2n entries
+ *
+ * Output Parameters:
+ * + perm - The ordering
+ * - hash - Fingerprint of A in that ordering
+ *
+ * Note:
+ *  Dofs are coloured by their diagonal entry, then the colours are
+ *  refined by the rows (see PCPatchRefineColours_Private).  While some
+ *  dofs can't be told apart, one dof of the smallest such class (the
+ *  lowest colour of those) is given a colour of its own and the
+ *  colours refined again.  This breaks ties canonically, but two
+ *  equivalent operators need not end in the same ordering, and hash
+ *  collisions can pair inequivalent ones, so callers compare the
+ *  matrices before sharing.  Sorting by colour gives the ordering.
+ */
+static PetscErrorCode PCPatchCanonicalOrdering_Private(PetscInt n, const PetscScalar *A, PetscReal scale,
+                                                       PetscInt *work, PetscInt *perm, PetscInt64 *hash)
+{
+    PetscErrorCode ierr;
+    PetscInt      *colour = work;
+    PetscInt      *next   = work + n;
+    PetscInt64     h      = n;
+    PetscInt       nclass;
+
+    PetscFunctionBegin;
+    for ( PetscInt a = 0; a < n; a++ ) {
+        colour[a] = (PetscInt)(PCPatchHashValue_Private(A[a*n + a], scale) & PETSC_MAX_INT);
+    }
+    /* perm is scratch for the sorted colours until the end. */
+    ierr = PCPatchRefineColours_Private(n, A, scale, colour, next, perm, &nclass); CHKERRQ(ierr);
+    for ( PetscInt iter = 0; nclass < n && iter < n; iter++ ) {
+        PetscInt tied = -1, size = PETSC_MAX_INT;
+        for ( PetscInt a = 0, b; a < n; a = b ) {
+            for ( b = a + 1; b < n && perm[b] == perm[a]; b++ );
+            if (b - a > 1 && b - a < size) {
+                size = b - a;
+                tied = perm[a];
+            }
+        }
+        for ( PetscInt a = 0; a < n; a++ ) {
+            if (colour[a] != tied) continue;
+            colour[a] = (PetscInt)(PCPatchHashCombine_Private(tied, n + iter) & PETSC_MAX_INT);
+            break;
+        }
+        ierr = PCPatchRefineColours_Private(n, A, scale, colour, next, perm, &nclass); CHKERRQ(ierr);
+    }
+    for ( PetscInt a = 0; a < n; a++ ) perm[a] = a;
+    ierr = PetscSortIntWithArray(n, colour, perm); CHKERRQ(ierr);
+    for ( PetscInt a = 0; a < n; a++ ) {
+        for ( PetscInt b = 0; b < n; b++ ) {
+            h = PCPatchHashCombine_Private(h, PCPatchHashValue_Private(A[perm[b]*n + perm[a]], scale));
+        }
+    }
+    *hash = h;
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchFactorDenseShared_Private"
+/*
+ * PCPatchFactorDenseShared_Private - Assemble all dense patches and LU
+ * factor one representative of each class of equivalent operators.
+ *
+ * Note:
+ *  Each operator is put in canonical ordering (see
+ *  PCPatchCanonicalOrdering_Private) and looked up by its fingerprint
+ *  in an open addressing table of the representatives so far.  A
+ *  match is only accepted if the entries agree to a relative
+ *  tolerance.  The factor arena is rebuilt every time, it only holds
+ *  the representatives, which are factored after all the lookups.
+ */
+static PetscErrorCode PCPatchFactorDenseShared_Private(PC pc)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch    = (PC_PATCH *)pc->data;
+    const PetscInt  bs       = patch->bs;
+    const PetscReal rtol     = 1.e-12;
+    PetscScalar    *A        = NULL;
+    PetscInt       *work     = NULL;
+    PetscInt64     *tableHash = NULL;
+    PetscInt       *tableRep = NULL;
+    PetscInt64      totalFactor = 0, maxFactor;
+    PetscInt        pStart, pEnd, maxDof = 0, ndense = 0, tableSize;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, &pEnd); CHKERRQ(ierr);
+    if (!patch->densePerms) {
+        PetscInt localSize;
+        ierr = PetscSectionGetStorageSize(patch->gtolCounts, &localSize); CHKERRQ(ierr);
+        ierr = PetscMalloc1(localSize*bs, &patch->densePerms); CHKERRQ(ierr);
+        ierr = PetscMalloc1(patch->npatch, &patch->denseShared); CHKERRQ(ierr);
+    }
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        PetscInt dof;
+        patch->denseShared[i] = i;
+        if (patch->denseOffsets[i] < 0) continue;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i + pStart, &dof); CHKERRQ(ierr);
+        maxDof = PetscMax(maxDof, dof*bs);
+        ndense++;
+    }
+    /* Grows as representatives are found. */
+    maxFactor = (PetscInt64)maxDof*maxDof*PetscMin(ndense, 16);
+    ierr = PetscFree(patch->denseFactors); CHKERRQ(ierr);
+    ierr = PetscMalloc1(maxFactor, &patch->denseFactors); CHKERRQ(ierr);
+    ierr = PetscMalloc2((PetscInt64)maxDof*maxDof, &A, 2*maxDof, &work); CHKERRQ(ierr);
+    tableSize = 2*ndense + 1;
+    ierr = PetscMalloc2(tableSize, &tableHash, tableSize, &tableRep); CHKERRQ(ierr);
+    for ( PetscInt k = 0; k < tableSize; k++ ) tableRep[k] = -1;
+
+    patch->nuniqueFactors = 0;
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        PetscInt   *perm;
+        PetscInt64  hash;
+        PetscReal   scale = 0;
+        PetscInt    dof, off, n, k;
+        if (patch->denseOffsets[i] < 0) continue;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i + pStart, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->gtolCounts, i + pStart, &off); CHKERRQ(ierr);
+        n    = dof*bs;
+        perm = patch->densePerms + off*bs;
+        ierr = PCPatchAssembleDense_Private(pc, i, A); CHKERRQ(ierr);
+        for ( PetscInt a = 0; a < n*n; a++ ) scale = PetscMax(scale, PetscAbsScalar(A[a]));
+        if (scale == 0) scale = 1;
+        ierr = PCPatchCanonicalOrdering_Private(n, A, scale, work, perm, &hash); CHKERRQ(ierr);
+        for ( k = (PetscInt)((unsigned long long)hash % (unsigned long long)tableSize); tableRep[k] >= 0; k = (k + 1) % tableSize ) {
+            const PetscInt     rep = tableRep[k];
+            const PetscScalar *C   = patch->denseFactors + patch->denseOffsets[rep];
+            PetscInt           rdof;
+            PetscBool          same = PETSC_TRUE;
+            if (tableHash[k] != hash) continue;
+            ierr = PetscSectionGetDof(patch->gtolCounts, rep + pStart, &rdof); CHKERRQ(ierr);
+            if (rdof*bs != n) continue;
+            for ( PetscInt b = 0; b < n && same; b++ ) {
+                for ( PetscInt a = 0; a < n; a++ ) {
+                    if (PetscAbsScalar(C[b*n + a] - A[perm[b]*n + perm[a]]) > rtol*scale) {
+                        same = PETSC_FALSE;
+                        break;
+                    }
+                }
+            }
+            if (same) break;
+        }
+        if (tableRep[k] >= 0) {
+            /* Found an equivalent representative, use its factors. */
+            patch->denseShared[i]  = tableRep[k];
+            patch->denseOffsets[i] = patch->denseOffsets[tableRep[k]];
+            continue;
+        }
+        /* New representative, store its operator in canonical order. */
+        tableHash[k] = hash;
+        tableRep[k]  = i;
+        if (totalFactor + (PetscInt64)n*n > maxFactor) {
+            maxFactor = PetscMax(2*maxFactor, totalFactor + (PetscInt64)n*n);
+            ierr = PetscRealloc(sizeof(PetscScalar)*maxFactor, &patch->denseFactors); CHKERRQ(ierr);
+        }
+        patch->denseOffsets[i] = totalFactor;
+        for ( PetscInt b = 0; b < n; b++ ) {
+            for ( PetscInt a = 0; a < n; a++ ) {
+                patch->denseFactors[totalFactor + b*n + a] = A[perm[b]*n + perm[a]];
+            }
+        }
+        totalFactor += (PetscInt64)n*n;
+        patch->nuniqueFactors++;
+    }
+    ierr = PetscFree2(A, work); CHKERRQ(ierr);
+    ierr = PetscFree2(tableHash, tableRep); CHKERRQ(ierr);
+    ierr = PetscRealloc(sizeof(PetscScalar)*totalFactor, &patch->denseFactors); CHKERRQ(ierr);
+    patch->denseFactorSize = totalFactor;
+
+    /* Now factor the representatives. */
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        PetscBLASInt n, info;
+        PetscInt     dof, off;
+        if (patch->denseOffsets[i] < 0 || patch->denseShared[i] != i) continue;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i + pStart, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->gtolCounts, i + pStart, &off); CHKERRQ(ierr);
+        ierr = PetscBLASIntCast(dof*bs, &n); CHKERRQ(ierr);
+        PetscStackCallBLAS("LAPACKgetrf", LAPACKgetrf_(&n, &n, patch->denseFactors + patch->denseOffsets[i], &n,
+                                                       patch->densePivots + off*bs, &info));
+        if (info) {
+            SETERRQ2(PETSC_COMM_SELF, PETSC_ERR_LIB, "Error in LAPACK getrf on patch %D, info %d\n", i, (int)info);
+        }
+        ierr = PetscLogFlops((2.0*n*n*n)/3.0); CHKERRQ(ierr);
+    }
+    ierr = PetscInfo2(pc, "Kept %D unique factorisations for %D dense patches\n", patch->nuniqueFactors, ndense); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCreateTensorGrids"
+/*
+ * PCPatchCreateTensorGrids - Find the patches whose interior (non BC)
+ * dofs lie on an axis aligned tensor product grid.
+ *
+ * Output Parameters:
+ * + fdmDims - Grid sizes nx, ny of each patch, 0 if not a grid
+ * - fdmIdx - For grid patches, the patch dof at grid point (i, j),
+ *            stored at i*ny + j
+ *
+ * Note:
+ *  Only scalar problems in two dimensions.  Coordinates are grouped
+ *  along each axis to a tolerance relative to the patch extent.
+ */
+static PetscErrorCode PCPatchCreateTensorGrids(PC pc)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    const PetscInt *gtolArray;
+    PetscReal      *xs    = NULL, *ys = NULL;
+    PetscInt       *slot  = NULL;
+    PetscInt        pStart, localSize, maxDof = 0;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = PetscSectionGetStorageSize(patch->gtolCounts, &localSize); CHKERRQ(ierr);
+    ierr = PetscCalloc1(2*patch->npatch, &patch->fdmDims); CHKERRQ(ierr);
+    ierr = PetscMalloc1(patch->npatch, &patch->fdmOffsets); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) patch->fdmOffsets[i] = -1;
+    if (!patch->dofCoords) {
+        SETERRQ(PetscObjectComm((PetscObject)pc), PETSC_ERR_ARG_WRONGSTATE, "Fast diagonalisation needs dof coordinates, call PCPatchSetDofCoordinates()\n");
+    }
+    if (patch->bs != 1 || patch->coordDim != 2) {
+        ierr = PetscInfo(pc, "Fast diagonalisation needs scalar problems in 2D, using KSP\n"); CHKERRQ(ierr);
+        PetscFunctionReturn(0);
+    }
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        PetscInt dof;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i + pStart, &dof); CHKERRQ(ierr);
+        maxDof = PetscMax(maxDof, dof);
+    }
+    ierr = PetscMalloc1(localSize, &patch->fdmIdx); CHKERRQ(ierr);
+    ierr = PetscMalloc3(maxDof, &xs, maxDof, &ys, maxDof, &slot); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->gtol, &gtolArray); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        const PetscInt *idx = NULL;
+        PetscInt        dof, off, nint = 0, nx = 0, ny = 0;
+        PetscReal       tol;
+        PetscBool       grid = PETSC_TRUE;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i + pStart, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->gtolCounts, i + pStart, &off); CHKERRQ(ierr);
+        idx = patch->gatherIdx + off;
+        for ( PetscInt k = 0; k < dof; k++ ) {
+            if (idx[k] < 0) continue;
+            xs[nint]   = patch->dofCoords[2*gtolArray[off + k]];
+            ys[nint++] = patch->dofCoords[2*gtolArray[off + k] + 1];
+        }
+        if (nint < 4) continue;
+        ierr = PetscSortReal(nint, xs); CHKERRQ(ierr);
+        ierr = PetscSortReal(nint, ys); CHKERRQ(ierr);
+        tol = 1.e-8*(xs[nint - 1] - xs[0] + ys[nint - 1] - ys[0]);
+        /* Unique coordinates along each axis, in place. */
+        for ( PetscInt k = 0; k < nint; k++ ) {
+            if (!nx || xs[k] - xs[nx - 1] > tol) xs[nx++] = xs[k];
+            if (!ny || ys[k] - ys[ny - 1] > tol) ys[ny++] = ys[k];
+        }
+        if (nx < 2 || ny < 2 || nx*ny != nint) continue;
+        for ( PetscInt s = 0; s < nint; s++ ) slot[s] = -1;
+        for ( PetscInt k = 0; k < dof && grid; k++ ) {
+            PetscReal x, y;
+            PetscInt  ix = 0, iy = 0;
+            if (idx[k] < 0) continue;
+            x = patch->dofCoords[2*gtolArray[off + k]];
+            y = patch->dofCoords[2*gtolArray[off + k] + 1];
+            while (ix < nx && PetscAbsReal(xs[ix] - x) > tol) ix++;
+            while (iy < ny && PetscAbsReal(ys[iy] - y) > tol) iy++;
+            if (ix == nx || iy == ny || slot[ix*ny + iy] >= 0) {
+                grid = PETSC_FALSE;
+                break;
+            }
+            slot[ix*ny + iy] = k;
+        }
+        if (!grid) continue;
+        ierr = PetscMemcpy(patch->fdmIdx + off, slot, nint*sizeof(PetscInt)); CHKERRQ(ierr);
+        patch->fdmDims[2*i]     = nx;
+        patch->fdmDims[2*i + 1] = ny;
+    }
+    ierr = ISRestoreIndices(patch->gtol, &gtolArray); CHKERRQ(ierr);
+    ierr = PetscFree3(xs, ys, slot); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchApplyFastDiagonalisation_Private"
+/*
+ * PCPatchApplyFastDiagonalisation_Private - Solve on the interior grid
+ * of a patch, x = (V (x) W) D^-1 (V (x) W)^T b.
+ *
+ * Input Parameters:
+ * + nx, ny - Grid size
+ * . data - V (nx x nx), W (ny x ny), then D (nx*ny), column major
+ * . b - Right hand side, b[i*ny + j] at grid point (i, j)
+ * - work - Work space, nx*ny
+ *
+ * Output Parameters:
+ * . x - Solution, as b (may not alias b)
+ *
+ * Note:
+ *  Stored row major, b is the column major ny x nx matrix B^T, so this
+ *  is four small GEMMs: x^T = W ((W^T b^T V) ./ D^T) V^T.
+ */
+static PetscErrorCode PCPatchApplyFastDiagonalisation_Private(PetscInt nx, PetscInt ny, const PetscScalar *data,
+                                                              const PetscScalar *b, PetscScalar *work, PetscScalar *x)
+{
+    PetscErrorCode     ierr;
+    const PetscScalar *V = data, *W = data + nx*nx, *D = data + nx*nx + ny*ny;
+    const PetscScalar  one = 1.0, zero = 0.0;
+    PetscBLASInt       m, n;
+
+    PetscFunctionBegin;
+    ierr = PetscBLASIntCast(ny, &m); CHKERRQ(ierr);
+    ierr = PetscBLASIntCast(nx, &n); CHKERRQ(ierr);
+    PetscStackCallBLAS("BLASgemm", BLASgemm_("T", "N", &m, &n, &m, &one, W, &m, b, &m, &zero, work, &m));
+    PetscStackCallBLAS("BLASgemm", BLASgemm_("N", "N", &m, &n, &n, &one, work, &m, V, &n, &zero, x, &m));
+    for ( PetscInt k = 0; k < nx*ny; k++ ) x[k] /= D[k];
+    PetscStackCallBLAS("BLASgemm", BLASgemm_("N", "N", &m, &n, &m, &one, W, &m, x, &m, &zero, work, &m));
+    PetscStackCallBLAS("BLASgemm", BLASgemm_("N", "T", &m, &n, &n, &one, work, &m, V, &n, &zero, x, &m));
+    ierr = PetscLogFlops(4.0*nx*ny*(nx + ny) + nx*ny); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSimultaneousDiagonalise_Private"
+/*
+ * PCPatchSimultaneousDiagonalise_Private - Diagonalise a symmetric
+ * pair (P, Q) by a generalised eigendecomposition, using whichever of
+ * +P, -P, +Q, -Q is positive definite as the metric.
+ *
+ * Input Parameters:
+ * + n - Size
+ * . P, Q - The pair, column major (not modified)
+ * - work - Work space, 2n^2 + 3n
+ *
+ * Output Parameters:
+ * + X - Eigenvectors, X^T P X and X^T Q X are diagonal
+ * . dP, dQ - Diagonals of X^T P X and X^T Q X
+ * - found - Was any of them positive definite?
+ */
+static PetscErrorCode PCPatchSimultaneousDiagonalise_Private(PetscInt n, const PetscScalar *P, const PetscScalar *Q,
+                                                             PetscScalar *work, PetscScalar *X,
+                                                             PetscScalar *dP, PetscScalar *dQ, PetscBool *found)
+{
+    PetscErrorCode ierr;
+    PetscScalar   *M = work, *lwork = work + n*n;
+    PetscReal     *w;
+    PetscBLASInt   bn, itype = 1, lw, info = 1;
+
+    PetscFunctionBegin;
+    *found = PETSC_FALSE;
+#if defined(PETSC_USE_COMPLEX)
+    SETERRQ(PETSC_COMM_SELF, PETSC_ERR_SUP, "Fast diagonalisation needs real scalars\n");
+#else
+    ierr = PetscBLASIntCast(n, &bn); CHKERRQ(ierr);
+    ierr = PetscBLASIntCast(n*n + 2*n, &lw); CHKERRQ(ierr);
+    ierr = PetscMalloc1(n, &w); CHKERRQ(ierr);
+    for ( PetscInt c = 0; c < 4 && info; c++ ) {
+        const PetscScalar *metric = c < 2 ? P : Q;
+        const PetscScalar *other  = c < 2 ? Q : P;
+        const PetscScalar  sign   = c % 2 ? -1.0 : 1.0;
+        for ( PetscInt k = 0; k < n*n; k++ ) {
+            M[k] = sign*metric[k];
+            X[k] = other[k];
+        }
+        PetscStackCallBLAS("LAPACKsygv", LAPACKsygv_(&itype, "V", "U", &bn, X, &bn, M, &bn, w, lwork, &lw, &info));
+    }
+    ierr = PetscFree(w); CHKERRQ(ierr);
+    if (info) PetscFunctionReturn(0);
+    /* sygv normalises against the metric only, so just compute both
+     * diagonals. */
+    for ( PetscInt j = 0; j < n; j++ ) {
+        const PetscScalar *xj = X + j*n;
+        dP[j] = 0;
+        dQ[j] = 0;
+        for ( PetscInt a = 0; a < n; a++ ) {
+            PetscScalar pa = 0, qa = 0;
+            for ( PetscInt b = 0; b < n; b++ ) {
+                pa += P[b*n + a]*xj[b];
+                qa += Q[b*n + a]*xj[b];
+            }
+            dP[j] += xj[a]*pa;
+            dQ[j] += xj[a]*qa;
+        }
+    }
+    *found = PETSC_TRUE;
+#endif
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSetUpFastDiagonalisation_Private"
+/*
+ * PCPatchSetUpFastDiagonalisation_Private - Set up fast diagonalisation
+ * on every tensor grid patch whose operator is separable.
+ *
+ * Note:
+ *  The interior operator A is rearranged (Van Loan and Pitsianis) so
+ *  that A = B1 (x) C1 + B2 (x) C2 is a rank two matrix; an SVD finds
+ *  the terms or tells us the operator isn't separable.  Each pair is
+ *  then diagonalised simultaneously, so that
+ *  (V (x) W)^T A (V (x) W) = D is diagonal.  The result is checked
+ *  against the assembled operator; patches that fail any of these
+ *  steps are solved with their KSP.
+ */
+static PetscErrorCode PCPatchSetUpFastDiagonalisation_Private(PC pc)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    const PetscReal svdtol = 1.e-10, rtol = 1.e-8;
+    PetscScalar    *A = NULL, *R = NULL, *U = NULL, *VT = NULL, *svdWork = NULL;
+    PetscScalar    *B = NULL, *C = NULL, *work = NULL, *tmp = NULL;
+    PetscScalar    *dO = NULL, *dM = NULL;
+    PetscReal      *S = NULL;
+    PetscInt64      total = 0;
+    PetscInt        pStart, maxDof = 0, maxN = 0, maxNint = 0;
+
+    PetscFunctionBegin;
+#if defined(PETSC_USE_COMPLEX)
+    SETERRQ(PETSC_COMM_SELF, PETSC_ERR_SUP, "Fast diagonalisation needs real scalars\n");
+#else
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, NULL); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        const PetscInt nx = patch->fdmDims[2*i], ny = patch->fdmDims[2*i + 1];
+        PetscInt       dof;
+        patch->fdmOffsets[i] = -1;
+        if (!nx) continue;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i + pStart, &dof); CHKERRQ(ierr);
+        maxDof  = PetscMax(maxDof, dof);
+        maxN    = PetscMax(maxN, PetscMax(nx, ny));
+        maxNint = PetscMax(maxNint, nx*ny);
+        patch->fdmOffsets[i] = total;
+        total += nx*nx + ny*ny + nx*ny;
+    }
+    ierr = PetscFree(patch->fdmData); CHKERRQ(ierr);
+    ierr = PetscMalloc1(total, &patch->fdmData); CHKERRQ(ierr);
+    ierr = PetscFree(patch->fdmWork); CHKERRQ(ierr);
+    ierr = PetscMalloc1(3*maxNint, &patch->fdmWork); CHKERRQ(ierr);
+    ierr = PetscMalloc4((size_t)maxDof*maxDof, &A, (size_t)maxNint*maxNint, &R,
+                        (size_t)maxN*maxN*maxN*maxN, &U, (size_t)maxN*maxN*maxN*maxN, &VT); CHKERRQ(ierr);
+    ierr = PetscMalloc4(5*maxN*maxN, &svdWork, 4*maxN*maxN, &B, 4*maxN*maxN, &C, 2*maxN*maxN + 3*maxN, &work); CHKERRQ(ierr);
+    ierr = PetscMalloc4(maxN*maxN, &S, maxN, &dO, maxN, &dM, 2*maxNint, &tmp); CHKERRQ(ierr);
+
+    patch->nfdm = 0;
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        const PetscInt  nx  = patch->fdmDims[2*i], ny = patch->fdmDims[2*i + 1];
+        const PetscInt  nint = nx*ny;
+        PetscScalar    *V, *W, *D;
+        const PetscInt *idx;
+        PetscBLASInt    m, n, mn, lw, info;
+        PetscReal       tail = 0, res = 0, bnorm = 0, dmax = 0;
+        PetscBool       found;
+        PetscInt        dof, off;
+        if (patch->fdmOffsets[i] < 0) continue;
+        V = patch->fdmData + patch->fdmOffsets[i];
+        W = V + nx*nx;
+        D = W + ny*ny;
+        ierr = PetscSectionGetDof(patch->gtolCounts, i + pStart, &dof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->gtolCounts, i + pStart, &off); CHKERRQ(ierr);
+        idx = patch->fdmIdx + off;
+        ierr = PCPatchAssembleDense_Private(pc, i, A); CHKERRQ(ierr);
+
+        /* Rearrange: R[(i + k nx), (j + l ny)] = A[(i, j), (k, l)]. */
+        for ( PetscInt a = 0; a < nx; a++ ) for ( PetscInt b = 0; b < ny; b++ ) {
+            for ( PetscInt k = 0; k < nx; k++ ) for ( PetscInt l = 0; l < ny; l++ ) {
+                R[(size_t)(b + l*ny)*nx*nx + a + k*nx] = A[(size_t)idx[k*ny + l]*dof + idx[a*ny + b]];
+            }
+        }
+        ierr = PetscBLASIntCast(nx*nx, &m); CHKERRQ(ierr);
+        ierr = PetscBLASIntCast(ny*ny, &n); CHKERRQ(ierr);
+        mn = PetscMin(m, n);
+        ierr = PetscBLASIntCast(5*maxN*maxN, &lw); CHKERRQ(ierr);
+        PetscStackCallBLAS("LAPACKgesvd", LAPACKgesvd_("S", "S", &m, &n, R, &m, S, U, &m, VT, &mn, svdWork, &lw, &info));
+        if (info) goto fallback;
+        for ( PetscInt s = 2; s < mn; s++ ) tail += S[s]*S[s];
+        if (S[1] <= svdtol*S[0] || PetscSqrtReal(tail) > svdtol*S[0]) goto fallback;
+
+        /* The two terms, symmetrised. */
+        for ( PetscInt a = 0; a < nx; a++ ) for ( PetscInt k = 0; k < nx; k++ ) {
+            for ( PetscInt t = 0; t < 2; t++ ) {
+                B[t*nx*nx + k*nx + a] = 0.5*S[t]*(U[t*m + a + k*nx] + U[t*m + k + a*nx]);
+            }
+        }
+        for ( PetscInt b = 0; b < ny; b++ ) for ( PetscInt l = 0; l < ny; l++ ) {
+            for ( PetscInt t = 0; t < 2; t++ ) {
+                C[t*ny*ny + l*ny + b] = 0.5*(VT[t + (b + l*ny)*mn] + VT[t + (l + b*ny)*mn]);
+            }
+        }
+        /* V^T B1 V = diag(dO), V^T B2 V = diag(dM).  Then, with W
+         * diagonalising C1 and C2 as well, D = dO (x) e1 + dM (x) e2. */
+        ierr = PCPatchSimultaneousDiagonalise_Private(nx, B, B + nx*nx, work, V, dO, dM, &found); CHKERRQ(ierr);
+        if (!found) goto fallback;
+        for ( PetscInt a = 0; a < nx; a++ ) {
+            tmp[a]      = dO[a];
+            tmp[nx + a] = dM[a];
+        }
+        ierr = PCPatchSimultaneousDiagonalise_Private(ny, C, C + ny*ny, work, W, dO, dM, &found); CHKERRQ(ierr);
+        if (!found) goto fallback;
+        for ( PetscInt a = 0; a < nx; a++ ) for ( PetscInt b = 0; b < ny; b++ ) {
+            D[a*ny + b] = tmp[a]*dO[b] + tmp[nx + a]*dM[b];
+            dmax = PetscMax(dmax, PetscAbsScalar(D[a*ny + b]));
+        }
+        for ( PetscInt k = 0; k < nint; k++ ) {
+            if (PetscAbsScalar(D[k]) <= svdtol*dmax) goto fallback;
+        }
+
+        /* Check against the assembled operator. */
+        for ( PetscInt k = 0; k < nint; k++ ) {
+            tmp[k] = 1.0 + (k % 7);
+            bnorm += PetscRealPart(tmp[k]*tmp[k]);
+        }
+        ierr = PCPatchApplyFastDiagonalisation_Private(nx, ny, V, tmp, patch->fdmWork, tmp + nint); CHKERRQ(ierr);
+        for ( PetscInt a = 0; a < nint; a++ ) {
+            PetscScalar r = -tmp[a];
+            for ( PetscInt b = 0; b < nint; b++ ) r += A[(size_t)idx[b]*dof + idx[a]]*tmp[nint + b];
+            res += PetscRealPart(r*r);
+        }
+        if (PetscSqrtReal(res) > rtol*PetscSqrtReal(bnorm)) goto fallback;
+        patch->nfdm++;
+        continue;
+    fallback:
+        patch->fdmOffsets[i] = -1;
+    }
+    ierr = PetscFree4(A, R, U, VT); CHKERRQ(ierr);
+    ierr = PetscFree4(svdWork, B, C, work); CHKERRQ(ierr);
+    ierr = PetscFree4(S, dO, dM, tmp); CHKERRQ(ierr);
+    ierr = PetscInfo2(pc, "Fast diagonalisation on %D of %D patches\n", patch->nfdm, patch->npatch); CHKERRQ(ierr);
+#endif
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSolveFastDiagonalisation_Private"
+/*
+ * PCPatchSolveFastDiagonalisation_Private - Solve on a patch set up for
+ * fast diagonalisation.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . which - Index of the patch
+ * - x - Right hand side, patch sized, zero on the patch BCs
+ *
+ * Output Parameters:
+ * . y - Solution, patch sized
+ */
+static PetscErrorCode PCPatchSolveFastDiagonalisation_Private(PC pc, PetscInt which, const PetscScalar *x, PetscScalar *y)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    const PetscInt  nx    = patch->fdmDims[2*which], ny = patch->fdmDims[2*which + 1];
+    PetscScalar    *b     = patch->fdmWork, *z = patch->fdmWork + nx*ny, *work = patch->fdmWork + 2*nx*ny;
+    const PetscInt *idx;
+    PetscInt        pStart, dof, off;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = PetscSectionGetDof(patch->gtolCounts, which + pStart, &dof); CHKERRQ(ierr);
+    ierr = PetscSectionGetOffset(patch->gtolCounts, which + pStart, &off); CHKERRQ(ierr);
+    idx = patch->fdmIdx + off;
+    /* The BC rows are the identity. */
+    ierr = PetscMemcpy(y, x, dof*sizeof(PetscScalar)); CHKERRQ(ierr);
+    for ( PetscInt k = 0; k < nx*ny; k++ ) b[k] = x[idx[k]];
+    ierr = PCPatchApplyFastDiagonalisation_Private(nx, ny, patch->fdmData + patch->fdmOffsets[which], b, work, z); CHKERRQ(ierr);
+    for ( PetscInt k = 0; k < nx*ny; k++ ) y[idx[k]] = z[k];
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchConvertFactorsSingle_Private"
+/*
+ * PCPatchConvertFactorsSingle_Private - Round the shared dense LU
+ * factors to single precision and release the double precision arena.
+ *
+ * Note:
+ *  Factorisation is still done in double precision, only the stored
+ *  factors are rounded.  Shared factors need the whole double arena,
+ *  as patches are compared against the unfactored representatives;
+ *  it is reallocated at the next PCSetUp.  Unshared factors are
+ *  rounded one patch at a time, see PCPatchFactorDense_Private.
+ */
+static PetscErrorCode PCPatchConvertFactorsSingle_Private(PC pc)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+
+    PetscFunctionBegin;
+    ierr = PetscFree(patch->denseFactorsSingle); CHKERRQ(ierr);
+    ierr = PetscMalloc1(patch->denseFactorSize, &patch->denseFactorsSingle); CHKERRQ(ierr);
+    for ( PetscInt64 k = 0; k < patch->denseFactorSize; k++ ) {
+        patch->denseFactorsSingle[k] = (float)PetscRealPart(patch->denseFactors[k]);
+    }
+    ierr = PetscFree(patch->denseFactors); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+/*
+ * Solve with single precision LU factors (as from getrf, column major)
+ * in place, accumulating in the precision of b.
+ */
+PETSC_STATIC_INLINE void PCPatchLUSolveSingle_Private(PetscBLASInt n, const float *LU, const PetscBLASInt *ipiv, PetscScalar *b)
+{
+    /* Row interchanges, in order. */
+    for ( PetscBLASInt i = 0; i < n; i++ ) {
+        const PetscBLASInt p = ipiv[i] - 1;
+        if (p != i) {
+            const PetscScalar t = b[i];
+            b[i] = b[p];
+            b[p] = t;
+        }
+    }
+    /* Forward substitution with unit lower triangular L, by columns
+     * so that the factors are read contiguously. */
+    for ( PetscBLASInt j = 0; j < n; j++ ) {
+        const PetscScalar bj  = b[j];
+        const float      *col = LU + (size_t)j*n;
+        for ( PetscBLASInt i = j + 1; i < n; i++ ) b[i] -= col[i]*bj;
+    }
+    /* Backward substitution with U. */
+    for ( PetscBLASInt j = n - 1; j >= 0; j-- ) {
+        const float      *col = LU + (size_t)j*n;
+        const PetscScalar bj  = b[j] /= col[j];
+        for ( PetscBLASInt i = 0; i < j; i++ ) b[i] -= col[i]*bj;
+    }
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchSolveDense_Private"
+/*
+ * PCPatchSolveDense_Private - Apply stored dense LU factors of a patch.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . which - Index of the patch
+ * - x - Right hand side, patch sized
+ *
+ * Output Parameters:
+ * . y - Solution, patch sized (may alias x)
+ *
+ * Note:
+ *  If factors are shared, x and y are in the patch's canonical
+ *  ordering (densePerms).
+ */
+static PetscErrorCode PCPatchSolveDense_Private(PC pc, PetscInt which, const PetscScalar *x, PetscScalar *y)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    PetscBLASInt    n, one = 1, info;
+    PetscInt        pStart, dof, off;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = PetscSectionGetDof(patch->gtolCounts, which + pStart, &dof); CHKERRQ(ierr);
+    ierr = PetscSectionGetOffset(patch->gtolCounts, which + pStart, &off); CHKERRQ(ierr);
+    ierr = PetscBLASIntCast(dof*patch->bs, &n); CHKERRQ(ierr);
+    if (x != y) {
+        ierr = PetscMemcpy(y, x, n*sizeof(PetscScalar)); CHKERRQ(ierr);
+    }
+    if (patch->denseShared) {
+        /* Pivots live with the factors. */
+        ierr = PetscSectionGetOffset(patch->gtolCounts, patch->denseShared[which] + pStart, &off); CHKERRQ(ierr);
+    }
+    if (patch->denseFactorsSingle) {
+        PCPatchLUSolveSingle_Private(n, patch->denseFactorsSingle + patch->denseOffsets[which],
+                                     patch->densePivots + off*patch->bs, y);
+        ierr = PetscLogFlops(2.0*n*n - n); CHKERRQ(ierr);
+        PetscFunctionReturn(0);
+    }
+    PetscStackCallBLAS("LAPACKgetrs", LAPACKgetrs_("N", &n, &one, patch->denseFactors + patch->denseOffsets[which],
+                                                   &n, patch->densePivots + off*patch->bs, y, &n, &info));
+    if (info) {
+        SETERRQ2(PETSC_COMM_SELF, PETSC_ERR_LIB, "Error in LAPACK getrs on patch %D, info %d\n", which, (int)info);
+    }
+    ierr = PetscLogFlops(2.0*n*n - n); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+/*
+ * Gather a patch vector from a local vector through its gather table,
+ * zeroing the patch BC entries.  If perm is given, y comes out in
+ * that order (y[k] is patch entry perm[k]).
+ */
+PETSC_STATIC_INLINE void PCPatchGather_Private(PetscInt n, const PetscInt *idx, const PetscInt *perm, const PetscScalar *x, PetscScalar *y)
+{
+    if (perm) {
+        for ( PetscInt k = 0; k < n; k++ ) {
+            const PetscInt j = idx[perm[k]];
+            y[k] = j >= 0 ? x[j] : (PetscScalar)0.0;
+        }
+        return;
+    }
+    for ( PetscInt k = 0; k < n; k++ ) {
+        y[k] = idx[k] >= 0 ? x[idx[k]] : (PetscScalar)0.0;
+    }
+}
+
+/*
+ * Add a patch vector into a local vector, skipping the patch BC
+ * entries.  If perm is given, x is in that order.
+ */
+PETSC_STATIC_INLINE void PCPatchScatterAdd_Private(PetscInt n, const PetscInt *idx, const PetscInt *perm, const PetscScalar *x, PetscScalar *y)
+{
+    if (perm) {
+        for ( PetscInt k = 0; k < n; k++ ) {
+            const PetscInt j = idx[perm[k]];
+            if (j >= 0) y[j] += x[k];
+        }
+        return;
+    }
+    for ( PetscInt k = 0; k < n; k++ ) {
+        if (idx[k] >= 0) y[idx[k]] += x[k];
+    }
+}
+
+/*
+ * Add alpha times a patch vector into a local vector, including the
+ * patch BC entries (for residual updates).
+ */
+PETSC_STATIC_INLINE void PCPatchScatterAXPYAll_Private(PetscInt n, PetscScalar alpha, const PetscInt *idx, const PetscScalar *x, PetscScalar *y)
+{
+    for ( PetscInt k = 0; k < n; k++ ) {
+        const PetscInt j = idx[k] >= 0 ? idx[k] : -(idx[k] + 1);
+        y[j] += alpha*x[k];
+    }
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCondenseRhs_Private"
+/*
+ * PCPatchCondenseRhs_Private - Eliminate the cell interiors from the
+ * right hand side, x_b <- x_b - K_bi K_ii^-1 x_i for every cached cell.
+ *
+ * Note:
+ *  Every cell around a patch dof that isn't a patch BC is in the patch,
+ *  so the condensed right hand side is the same for all patches and is
+ *  formed once per application.  Interior entries are left alone.
+ */
+static PetscErrorCode PCPatchCondenseRhs_Private(PC pc, PetscScalar *localX)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    const PetscInt  bs    = patch->bs;
+    const PetscInt  npc   = patch->nodesPerCell;
+    const PetscInt  ni    = patch->ncellInterior*bs, nb = npc*bs - ni;
+    const PetscInt *idx   = patch->condenseIdx;
+    PetscScalar    *xi    = patch->condenseWork;
+
+    PetscFunctionBegin;
+    for ( PetscInt slot = 0; slot < patch->nelementSlots; slot++ ) {
+        const PetscInt    *nodes = patch->cellNodeMap + patch->elementCells[slot]*npc;
+        const PetscScalar *F     = patch->condenseData + (size_t)slot*(ni*ni + 2*ni*nb) + ni*ni + ni*nb;
+        for ( PetscInt r = 0; r < ni; r++ ) xi[r] = localX[nodes[idx[r]/bs]*bs + idx[r]%bs];
+        for ( PetscInt t = 0; t < nb; t++ ) {
+            const PetscInt e   = idx[ni + t];
+            PetscScalar    sum = 0;
+            for ( PetscInt r = 0; r < ni; r++ ) sum += F[r*nb + t]*xi[r];
+            localX[nodes[e/bs]*bs + e%bs] -= sum;
+        }
+    }
+    ierr = PetscLogFlops(2.0*patch->nelementSlots*ni*nb); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchRecoverInterior_Private"
+/*
+ * PCPatchRecoverInterior_Private - Recover the cell interior part of a
+ * patch solution and add it into the local solution,
+ * u_i = K_ii^-1 x_i - K_ii^-1 K_ib u_b for each cell of the patch.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . which - Index of the patch
+ * . localX - The right hand side
+ * - u - Patch solution (in patch ordering)
+ *
+ * Output Parameters:
+ * . localY - The solution
+ */
+static PetscErrorCode PCPatchRecoverInterior_Private(PC pc, PetscInt which, const PetscScalar *localX,
+                                                     const PetscScalar *u, PetscScalar *localY)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    const PetscInt  bs    = patch->bs;
+    const PetscInt  npc   = patch->nodesPerCell;
+    const PetscInt  ni    = patch->ncellInterior*bs, nb = npc*bs - ni;
+    const PetscInt *idx   = patch->condenseIdx;
+    PetscScalar    *xi    = patch->condenseWork, *ub = patch->condenseWork + ni;
+    const PetscInt *dofsArray, *cellsArray;
+    PetscInt        pStart, ncell, off;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->cellCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = PetscSectionGetDof(patch->cellCounts, which + pStart, &ncell); CHKERRQ(ierr);
+    ierr = PetscSectionGetOffset(patch->cellCounts, which + pStart, &off); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->dofs, &dofsArray); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    for ( PetscInt c = off; c < off + ncell; c++ ) {
+        const PetscInt    *nodes    = patch->cellNodeMap + cellsArray[c]*npc;
+        const PetscInt    *cellDofs = dofsArray + c*npc;
+        const PetscScalar *Kinv     = patch->condenseData + (size_t)patch->elementSlots[cellsArray[c]]*(ni*ni + 2*ni*nb);
+        const PetscScalar *E        = Kinv + ni*ni;
+        for ( PetscInt r = 0; r < ni; r++ ) xi[r] = localX[nodes[idx[r]/bs]*bs + idx[r]%bs];
+        for ( PetscInt t = 0; t < nb; t++ ) {
+            const PetscInt e = idx[ni + t];
+            /* Boundary dofs may be out of the patch, and vanish. */
+            ub[t] = cellDofs[e/bs] >= 0 ? u[cellDofs[e/bs]*bs + e%bs] : (PetscScalar)0.0;
+        }
+        for ( PetscInt r = 0; r < ni; r++ ) {
+            PetscScalar sum = 0;
+            for ( PetscInt s = 0; s < ni; s++ ) sum += Kinv[s*ni + r]*xi[s];
+            for ( PetscInt t = 0; t < nb; t++ ) sum -= E[t*ni + r]*ub[t];
+            localY[nodes[idx[r]/bs]*bs + idx[r]%bs] += sum;
+        }
+    }
+    ierr = ISRestoreIndices(patch->dofs, &dofsArray); CHKERRQ(ierr);
+    ierr = ISRestoreIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    ierr = PetscLogFlops(2.0*ncell*ni*(ni + nb)); CHKERRQ(ierr);
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchCreateGatherTable"
+/*
+ * PCPatchCreateGatherTable - Flatten gtol and the patch BCs into one
+ * table of local vector entries for every patch entry.
+ *
+ * Output Parameters:
+ * . gatherIdx - Offset by gtolCounts (times the block size).  Patch BC
+ *               entries are stored as -(idx+1).
+ */
+static PetscErrorCode PCPatchCreateGatherTable(PC pc)
+{
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    const PetscInt  bs    = patch->bs;
+    const PetscInt *gtolArray;
+    PetscInt        pStart, pEnd, numDofs;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, &pEnd); CHKERRQ(ierr);
+    ierr = PetscSectionGetStorageSize(patch->gtolCounts, &numDofs); CHKERRQ(ierr);
+    ierr = PetscMalloc1(numDofs*bs, &patch->gatherIdx); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->gtol, &gtolArray); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < numDofs; i++ ) {
+        for ( PetscInt j = 0; j < bs; j++ ) {
+            patch->gatherIdx[i*bs + j] = gtolArray[i]*bs + j;
+        }
+    }
+    ierr = ISRestoreIndices(patch->gtol, &gtolArray); CHKERRQ(ierr);
+    for ( PetscInt p = pStart; p < pEnd; p++ ) {
+        const PetscInt *bcNodes;
+        PetscInt        numBcs, off;
+        ierr = PetscSectionGetOffset(patch->gtolCounts, p, &off); CHKERRQ(ierr);
+        ierr = ISBlockGetLocalSize(patch->bcs[p - pStart], &numBcs); CHKERRQ(ierr);
+        ierr = ISBlockGetIndices(patch->bcs[p - pStart], &bcNodes); CHKERRQ(ierr);
+        for ( PetscInt i = 0; i < numBcs; i++ ) {
+            for ( PetscInt j = 0; j < bs; j++ ) {
+                PetscInt *idx = patch->gatherIdx + (off + bcNodes[i])*bs + j;
+                *idx = -(*idx + 1);
+            }
+        }
+        ierr = ISBlockRestoreIndices(patch->bcs[p - pStart], &bcNodes); CHKERRQ(ierr);
     }
-    ierr = PetscFree(pc->data); CHKERRQ(ierr);
     PetscFunctionReturn(0);
 }
 
 #undef __FUNCT__
-#define __FUNCT__ "PCPatchCreateMatrix"
-static PetscErrorCode PCPatchCreateMatrix(PC pc, Vec x, Vec y, Mat *mat)
+#define __FUNCT__ "PCPatchCacheEvict_Private"
+/*
+ * PCPatchCacheEvict_Private - Drop a patch from the cache of set up
+ * KSPs, releasing its operator, factors and work vectors.
+ */
+static PetscErrorCode PCPatchCacheEvict_Private(PC pc, PetscInt i)
 {
     PetscErrorCode  ierr;
     PC_PATCH       *patch = (PC_PATCH *)pc->data;
-    PetscInt        csize, rsize, cbs, rbs;
 
     PetscFunctionBegin;
-    ierr = VecGetSize(x, &csize); CHKERRQ(ierr);
-    ierr = VecGetBlockSize(x, &cbs); CHKERRQ(ierr);
-    ierr = VecGetSize(y, &rsize); CHKERRQ(ierr);
-    ierr = VecGetBlockSize(y, &rbs); CHKERRQ(ierr);
-    ierr = MatCreate(PETSC_COMM_SELF, mat); CHKERRQ(ierr);
-    if (patch->sub_mat_type) {
-        ierr = MatSetType(*mat, patch->sub_mat_type); CHKERRQ(ierr);
-    }
-    ierr = MatSetSizes(*mat, rsize, csize, rsize, csize); CHKERRQ(ierr);
-    ierr = MatSetBlockSizes(*mat, rbs, cbs); CHKERRQ(ierr);
-    ierr = MatSetUp(*mat); CHKERRQ(ierr);
-    
+    if (patch->lruPrev[i] >= 0) patch->lruNext[patch->lruPrev[i]] = patch->lruNext[i];
+    else patch->lruHead = patch->lruNext[i];
+    if (patch->lruNext[i] >= 0) patch->lruPrev[patch->lruNext[i]] = patch->lruPrev[i];
+    else patch->lruTail = patch->lruPrev[i];
+    patch->lruCached[i] = PETSC_FALSE;
+    patch->lruTotal    -= patch->lruBytes[i];
+    patch->ncached--;
+    /* Keeps the types and options. */
+    ierr = KSPReset(patch->ksp[i]); CHKERRQ(ierr);
     PetscFunctionReturn(0);
 }
 
 #undef __FUNCT__
-#define __FUNCT__ "PCPatchComputeOperator"
-static PetscErrorCode PCPatchComputeOperator(PC pc, Mat mat, PetscInt which)
+#define __FUNCT__ "PCPatchCacheInsert_Private"
+/*
+ * PCPatchCacheInsert_Private - Keep the set up KSP of a patch as the
+ * most recently used, or touch it if already kept, evicting the least
+ * recently used ones while over budget.
+ *
+ * Note:
+ *  The memory of a patch is estimated from the allocated nonzeros of
+ *  its operator and, for factorisation PCs, of its factor, plus the
+ *  KSP's work vectors.  Shells count the element matrices they read,
+ *  though these are shared with other patches and not freed on
+ *  eviction.  The patch just inserted is never evicted.
+ */
+static PetscErrorCode PCPatchCacheInsert_Private(PC pc, PetscInt i)
 {
     PetscErrorCode  ierr;
-    PC_PATCH       *patch = (PC_PATCH *)pc->data;
-    const PetscInt *dofsArray;
-    const PetscInt *cellsArray;
-    PetscInt        ncell, offset, pStart, pEnd;
+    PC_PATCH       *patch  = (PC_PATCH *)pc->data;
+    const PetscReal budget = patch->cache_mb*1024.0*1024.0;
 
     PetscFunctionBegin;
-
-    ierr = PetscLogEventBegin(PC_Patch_ComputeOp, pc, 0, 0, 0); CHKERRQ(ierr);
-    if (!patch->usercomputeop) {
-        SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_WRONGSTATE, "Must call PCPatchSetComputeOperator() to set user callback\n");
+    if (patch->lruCached[i]) {
+        /* Move to the front. */
+        if (patch->lruHead == i) PetscFunctionReturn(0);
+        patch->lruNext[patch->lruPrev[i]] = patch->lruNext[i];
+        if (patch->lruNext[i] >= 0) patch->lruPrev[patch->lruNext[i]] = patch->lruPrev[i];
+        else patch->lruTail = patch->lruPrev[i];
+    } else {
+        const PetscLogDouble entry = sizeof(PetscScalar) + sizeof(PetscInt);
+        Mat                  A;
+        PC                   subpc;
+        MatInfo              info;
+        PetscBool            has, isfactor, isshell;
+        PetscInt             n;
+        patch->lruBytes[i] = 0;
+        ierr = KSPGetOperators(patch->ksp[i], &A, NULL); CHKERRQ(ierr);
+        ierr = MatHasOperation(A, MATOP_GET_INFO, &has); CHKERRQ(ierr);
+        if (has) {
+            ierr = MatGetInfo(A, MAT_LOCAL, &info); CHKERRQ(ierr);
+            patch->lruBytes[i] += info.nz_allocated*entry;
+        }
+        ierr = PetscObjectTypeCompare((PetscObject)A, MATSHELL, &isshell); CHKERRQ(ierr);
+        if (isshell) {
+            const PetscInt ne = patch->nodesPerCell*patch->bs;
+            PetscInt       ncell, pStart;
+            ierr = PetscSectionGetChart(patch->cellCounts, &pStart, NULL); CHKERRQ(ierr);
+            ierr = PetscSectionGetDof(patch->cellCounts, i + pStart, &ncell); CHKERRQ(ierr);
+            patch->lruBytes[i] += (PetscLogDouble)ncell*ne*ne*sizeof(PetscScalar);
+        }
+        ierr = MatGetLocalSize(A, &n, NULL); CHKERRQ(ierr);
+        patch->lruBytes[i] += (PetscLogDouble)patch->ksp[i]->nwork*n*sizeof(PetscScalar);
+        ierr = KSPGetPC(patch->ksp[i], &subpc); CHKERRQ(ierr);
+        ierr = PetscObjectTypeCompareAny((PetscObject)subpc, &isfactor, PCLU, PCCHOLESKY, PCILU, PCICC, ""); CHKERRQ(ierr);
+        if (isfactor) {
+            Mat F;
+            ierr = PCFactorGetMatrix(subpc, &F); CHKERRQ(ierr);
+            ierr = MatGetInfo(F, MAT_LOCAL, &info); CHKERRQ(ierr);
+            patch->lruBytes[i] += info.nz_allocated*entry;
+        }
+        patch->lruCached[i] = PETSC_TRUE;
+        patch->lruTotal    += patch->lruBytes[i];
+        patch->ncached++;
+        if (patch->lruTail < 0) patch->lruTail = i;
     }
-    ierr = ISGetIndices(patch->dofs, &dofsArray); CHKERRQ(ierr);
-    ierr = ISGetIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
-    ierr = PetscSectionGetChart(patch->cellCounts, &pStart, &pEnd); CHKERRQ(ierr);
-
-    which += pStart;
-    if (which >= pEnd) {
-        SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_OUTOFRANGE, "Asked for operator index is invalid\n"); CHKERRQ(ierr);
+    patch->lruPrev[i] = -1;
+    patch->lruNext[i] = patch->lruHead;
+    if (patch->lruHead >= 0) patch->lruPrev[patch->lruHead] = i;
+    patch->lruHead = i;
+    while (patch->lruTotal > budget && patch->lruTail != i) {
+        ierr = PCPatchCacheEvict_Private(pc, patch->lruTail); CHKERRQ(ierr);
     }
-
-    ierr = PetscSectionGetDof(patch->cellCounts, which, &ncell); CHKERRQ(ierr);
-    ierr = PetscSectionGetOffset(patch->cellCounts, which, &offset); CHKERRQ(ierr);
-    PetscStackPush("PCPatch user callback");
-    ierr = patch->usercomputeop(pc, mat, ncell, cellsArray + offset, ncell*patch->nodesPerCell, dofsArray + offset*patch->nodesPerCell, patch->usercomputectx); CHKERRQ(ierr);
-    PetscStackPop;
-    ierr = ISRestoreIndices(patch->dofs, &dofsArray); CHKERRQ(ierr);
-    ierr = ISRestoreIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
-    /* Apply boundary conditions.  Could also do this through the local_to_patch guy. */
-    ierr = MatZeroRowsColumnsIS(mat, patch->bcs[which-pStart], (PetscScalar)1.0, NULL, NULL); CHKERRQ(ierr);
-    ierr = PetscLogEventEnd(PC_Patch_ComputeOp, pc, 0, 0, 0); CHKERRQ(ierr);
     PetscFunctionReturn(0);
 }
 
 #undef __FUNCT__
-#define __FUNCT__ "PCPatch_ScatterLocal_Private"
-static PetscErrorCode PCPatch_ScatterLocal_Private(PC pc, PetscInt p,
-                                                   Vec x, Vec y,
-                                                   InsertMode mode,
-                                                   ScatterMode scat)
+#define __FUNCT__ "PCPatchFindDirtyPatches_Private"
+/*
+ * PCPatchFindDirtyPatches_Private - Decide which patches this PCSetUp
+ * rebuilds: those with a dirty cell, if dirty cells were marked or
+ * changes are detected, otherwise all of them.
+ *
+ * Note:
+ *  Shared and fast diagonalisation factors are kept in ways that
+ *  don't allow updating some patches, so with those every patch is
+ *  rebuilt.  Clears the dirty marks.
+ */
+static PetscErrorCode PCPatchFindDirtyPatches_Private(PC pc)
 {
-    PetscErrorCode ierr;
-    PC_PATCH          *patch   = (PC_PATCH *)pc->data;
-    const PetscScalar *xArray = NULL;
-    PetscScalar *yArray = NULL;
-    const PetscInt *gtolArray = NULL;
-    PetscInt offset, size;
-
-    PetscFunctionBeginHot;
-    ierr = PetscLogEventBegin(PC_Patch_Scatter, pc, 0, 0, 0); CHKERRQ(ierr);
-
-    ierr = VecGetArrayRead(x, &xArray); CHKERRQ(ierr);
-    ierr = VecGetArray(y, &yArray); CHKERRQ(ierr);
+    PetscErrorCode  ierr;
+    PC_PATCH       *patch = (PC_PATCH *)pc->data;
+    const PetscInt *cellsArray;
+    PetscBool       incremental;
+    PetscInt        pStart;
 
-    ierr = PetscSectionGetDof(patch->gtolCounts, p, &size); CHKERRQ(ierr);
-    ierr = PetscSectionGetOffset(patch->gtolCounts, p, &offset); CHKERRQ(ierr);
-    ierr = ISGetIndices(patch->gtol, &gtolArray); CHKERRQ(ierr);
-    if (mode == INSERT_VALUES && scat != SCATTER_FORWARD) {
-        SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_INCOMP, "Can't insert if not scattering forward\n");
-    }
-    if (mode == ADD_VALUES && scat != SCATTER_REVERSE) {
-        SETERRQ(PETSC_COMM_SELF, PETSC_ERR_ARG_INCOMP, "Can't add if not scattering reverse\n");
+    PetscFunctionBegin;
+    incremental = (pc->setupcalled && (patch->dirtyMarked || patch->detect_changes)) ? PETSC_TRUE : PETSC_FALSE;
+    if (patch->denseOffsets && patch->share_factors) incremental = PETSC_FALSE;
+    if (patch->fdmIdx) incremental = PETSC_FALSE;
+    if (!patch->patchDirty) {
+        ierr = PetscMalloc1(patch->npatch, &patch->patchDirty); CHKERRQ(ierr);
     }
-    for ( PetscInt i = 0; i < size; i++ ) {
-        for ( PetscInt j = 0; j < patch->bs; j++ ) {
-            const PetscInt gidx = gtolArray[i + offset]*patch->bs + j;
-            const PetscInt lidx = i*patch->bs + j;
-            if (mode == INSERT_VALUES) {
-                yArray[lidx] = xArray[gidx];
-            } else {
-                yArray[gidx] += xArray[lidx];
-            }
+    ierr = PetscSectionGetChart(patch->cellCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    patch->nrebuilt = 0;
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        PetscInt ncell, off;
+        patch->patchDirty[i] = incremental ? PETSC_FALSE : PETSC_TRUE;
+        ierr = PetscSectionGetDof(patch->cellCounts, i + pStart, &ncell); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->cellCounts, i + pStart, &off); CHKERRQ(ierr);
+        for ( PetscInt c = off; c < off + ncell && !patch->patchDirty[i]; c++ ) {
+            if (patch->cellDirty[cellsArray[c]]) patch->patchDirty[i] = PETSC_TRUE;
         }
+        if (patch->patchDirty[i]) patch->nrebuilt++;
     }
-    ierr = VecRestoreArrayRead(x, &xArray); CHKERRQ(ierr);
-    ierr = VecRestoreArray(y, &yArray); CHKERRQ(ierr);
-    ierr = ISRestoreIndices(patch->gtol, &gtolArray); CHKERRQ(ierr);
-    ierr = PetscLogEventEnd(PC_Patch_Scatter, pc, 0, 0, 0); CHKERRQ(ierr);
+    ierr = ISRestoreIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+    for ( PetscInt c = 0; c < patch->ncellNumbers; c++ ) patch->cellDirty[c] = PETSC_FALSE;
+    patch->dirtyMarked = PETSC_FALSE;
+    ierr = PetscInfo2(pc, "Rebuilding %D of %D patches\n", patch->nrebuilt, patch->npatch); CHKERRQ(ierr);
     PetscFunctionReturn(0);
 }
 
-
 #undef __FUNCT__
 #define __FUNCT__ "PCSetUp_PATCH"
 static PetscErrorCode PCSetUp_PATCH(PC pc)
@@ -862,9 +3940,6 @@ static PetscErrorCode PCSetUp_PATCH(PC pc)
     PetscErrorCode  ierr;
     PC_PATCH       *patch = (PC_PATCH *)pc->data;
     const char     *prefix;
-    PetscScalar    *patchX  = NULL;
-    PetscInt       pStart, numBcs;
-    const PetscInt *bcNodes = NULL;
 
     PetscFunctionBegin;
 
@@ -891,86 +3966,540 @@ static PetscErrorCode PCSetUp_PATCH(PC pc)
         ierr = VecSetBlockSize(patch->localX, patch->bs); CHKERRQ(ierr);
         ierr = VecSetUp(patch->localX); CHKERRQ(ierr);
         ierr = VecDuplicate(patch->localX, &patch->localY); CHKERRQ(ierr);
+        if (patch->condense && patch->type != PC_PATCH_ADDITIVE) {
+            ierr = PetscInfo(pc, "Static condensation needs additive patches, not condensing\n"); CHKERRQ(ierr);
+            patch->condense = PETSC_FALSE;
+        }
+        if (patch->condense) {
+            ierr = PCPatchFindCellInteriorNodes(pc); CHKERRQ(ierr);
+        }
+        if (patch->cellInterior) {
+            /* Condensation works on the element matrices. */
+            patch->cache_element_matrices = PETSC_TRUE;
+        }
         ierr = PCPatchCreateCellPatches(pc); CHKERRQ(ierr);
         ierr = PCPatchCreateCellPatchFacets(pc, &facetCounts, &facets); CHKERRQ(ierr);
         ierr = PCPatchCreateCellPatchDiscretisationInfo(pc, facetCounts, facets); CHKERRQ(ierr);
-        ierr = PCPatchCreateCellPatchBCs(pc, facetCounts, facets); CHKERRQ(ierr);
         ierr = PetscSectionDestroy(&facetCounts); CHKERRQ(ierr);
         ierr = ISDestroy(&facets); CHKERRQ(ierr);
+        ierr = PCPatchSquashEmptyPatches_Private(pc); CHKERRQ(ierr);
+        {
+            /* Only the patches that survived. */
+            PetscInt counts[2] = {0, patch->npatch}, total[2];
+            for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+                if (patch->truncated[i]) counts[0]++;
+            }
+            ierr = PetscFree(patch->truncated); CHKERRQ(ierr);
+            ierr = MPIU_Allreduce(counts, total, 2, MPIU_INT, MPI_SUM, PetscObjectComm((PetscObject)pc)); CHKERRQ(ierr);
+            patch->ntruncated = total[0];
+            if (total[0]) {
+                /* Not just PetscInfo: the smoother is silently weaker than
+                 * in serial, so say so whether or not -info is on. */
+                ierr = PetscPrintf(PetscObjectComm((PetscObject)pc), "WARNING: %D of %D patches are truncated by the partition, distribute the mesh with a vertex overlap\n", total[0], total[1]); CHKERRQ(ierr);
+            }
+        }
+        if (patch->reorder) {
+            ierr = PCPatchCreatePatchOrder(pc); CHKERRQ(ierr);
+        }
 
-        /* OK, now build the work vectors */
+        /* OK, now build the work space */
         ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, &pEnd); CHKERRQ(ierr);
-        ierr = PetscMalloc1(patch->npatch, &patch->patchX); CHKERRQ(ierr);
-        ierr = PetscMalloc1(patch->npatch, &patch->patchY); CHKERRQ(ierr);
-        for ( PetscInt i = pStart; i < pEnd; i++ ) {
-            PetscInt dof;
-            ierr = PetscSectionGetDof(patch->gtolCounts, i, &dof); CHKERRQ(ierr);
-            ierr = VecCreateSeq(PETSC_COMM_SELF, dof*patch->bs, &patch->patchX[i - pStart]); CHKERRQ(ierr);
-            ierr = VecSetBlockSize(patch->patchX[i - pStart], patch->bs); CHKERRQ(ierr);
-            ierr = VecSetUp(patch->patchX[i - pStart]); CHKERRQ(ierr);
-            ierr = VecCreateSeq(PETSC_COMM_SELF, dof*patch->bs, &patch->patchY[i - pStart]); CHKERRQ(ierr);
-            ierr = VecSetBlockSize(patch->patchY[i - pStart], patch->bs); CHKERRQ(ierr);
-            ierr = VecSetUp(patch->patchY[i - pStart]); CHKERRQ(ierr);
-        }
-        ierr = PetscMalloc1(patch->npatch, &patch->ksp); CHKERRQ(ierr);
+        ierr = PCPatchCreateGatherTable(pc); CHKERRQ(ierr);
+        ierr = PCPatchCreatePreallocation(pc); CHKERRQ(ierr);
+        ierr = PCPatchEstimateWork(pc); CHKERRQ(ierr);
+        ierr = PetscSectionGetStorageSize(patch->gtolCounts, &localSize); CHKERRQ(ierr);
+        ierr = PetscMalloc2(localSize*patch->bs, &patch->patchXArray,
+                            localSize*patch->bs, &patch->patchYArray); CHKERRQ(ierr);
+        if (patch->solver_type == PC_PATCH_SOLVER_DENSE) {
+            /* Lay out the factor arena: patches that are too big
+             * (or empty) keep a KSP. */
+            PetscInt64 totalFactor = 0;
+            ierr = PetscMalloc1(patch->npatch, &patch->denseOffsets); CHKERRQ(ierr);
+            for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+                PetscInt dof;
+                ierr = PetscSectionGetDof(patch->gtolCounts, i + pStart, &dof); CHKERRQ(ierr);
+                dof *= patch->bs;
+                if (dof > 0 && dof <= patch->dense_max_size) {
+                    patch->denseOffsets[i] = totalFactor;
+                    totalFactor += (PetscInt64)dof*dof;
+                    patch->denseMaxDof = PetscMax(patch->denseMaxDof, dof);
+                } else {
+                    patch->denseOffsets[i] = -1;
+                }
+            }
+            ierr = PetscSectionGetStorageSize(patch->gtolCounts, &localSize); CHKERRQ(ierr);
+            /* The arena itself is allocated when factoring.  If
+             * factors are shared, only the unique ones are stored, laid
+             * out at every PCSetUp. */
+            patch->denseFactorSize = totalFactor;
+            ierr = PetscMalloc1(localSize*patch->bs, &patch->densePivots); CHKERRQ(ierr);
+        }
+        if (patch->solver_type == PC_PATCH_SOLVER_FDM) {
+            /* These patches keep a KSP as well, for when the operator
+             * turns out not to be separable. */
+            ierr = PCPatchCreateTensorGrids(pc); CHKERRQ(ierr);
+        }
+        ierr = PetscCalloc1(patch->npatch, &patch->ksp); CHKERRQ(ierr);
         ierr = PCGetOptionsPrefix(pc, &prefix); CHKERRQ(ierr);
         for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+            if (patch->denseOffsets && patch->denseOffsets[i] >= 0) continue;
             ierr = KSPCreate(PETSC_COMM_SELF, patch->ksp + i); CHKERRQ(ierr);
             ierr = KSPSetOptionsPrefix(patch->ksp[i], prefix); CHKERRQ(ierr);
             ierr = KSPAppendOptionsPrefix(patch->ksp[i], "sub_"); CHKERRQ(ierr);
         }
+        /* Only KSPs and residual updates (MatMult) need Vecs. */
+        ierr = PetscCalloc1(patch->npatch, &patch->patchX); CHKERRQ(ierr);
+        ierr = PetscCalloc1(patch->npatch, &patch->patchY); CHKERRQ(ierr);
+        for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+            PetscInt dof, off;
+            if (!patch->ksp[i] && patch->type == PC_PATCH_ADDITIVE) continue;
+            ierr = PetscSectionGetDof(patch->gtolCounts, i + pStart, &dof); CHKERRQ(ierr);
+            ierr = PetscSectionGetOffset(patch->gtolCounts, i + pStart, &off); CHKERRQ(ierr);
+            ierr = VecCreateSeqWithArray(PETSC_COMM_SELF, patch->bs, dof*patch->bs,
+                                         patch->patchXArray + off*patch->bs, &patch->patchX[i]); CHKERRQ(ierr);
+            ierr = VecCreateSeqWithArray(PETSC_COMM_SELF, patch->bs, dof*patch->bs,
+                                         patch->patchYArray + off*patch->bs, &patch->patchY[i]); CHKERRQ(ierr);
+        }
+        if (patch->type == PC_PATCH_ADDITIVE && !patch->cellInterior) {
+            /* Only additive patches are independent of each other,
+             * so only they can run ahead of the halo exchange.  A
+             * condensed right hand side needs the halo. */
+            ierr = PCPatchClassifyPatches(pc); CHKERRQ(ierr);
+        }
+        if (patch->restricted && (patch->type != PC_PATCH_ADDITIVE || patch->cellInterior)) {
+            ierr = PetscInfo(pc, "Restricted Schwarz needs additive patches without condensation, not restricting\n"); CHKERRQ(ierr);
+            patch->restricted = PETSC_FALSE;
+        }
+        if (patch->restricted) {
+            ierr = PCPatchCreateRestriction(pc); CHKERRQ(ierr);
+        }
         if (patch->save_operators) {
-            ierr = PetscMalloc1(patch->npatch, &patch->mat); CHKERRQ(ierr);
+            ierr = PetscCalloc1(patch->npatch, &patch->mat); CHKERRQ(ierr);
             for ( PetscInt i = 0; i < patch->npatch; i++ ) {
-                ierr = PCPatchCreateMatrix(pc, patch->patchX[i], patch->patchY[i], patch->mat + i); CHKERRQ(ierr);
+                if (!patch->ksp[i]) continue;
+                ierr = PCPatchCreateOperator_Private(pc, i, PETSC_TRUE, patch->mat + i); CHKERRQ(ierr);
+            }
+            if (patch->type != PC_PATCH_ADDITIVE) {
+                ierr = PetscMalloc1(patch->npatch, &patch->matWithBcs); CHKERRQ(ierr);
+                for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+                    if (!patch->ksp[i]) {
+                        ierr = PCPatchCreateMatrix(pc, i, patch->matWithBcs + i); CHKERRQ(ierr);
+                    } else {
+                        ierr = PCPatchCreateOperator_Private(pc, i, PETSC_FALSE, patch->matWithBcs + i); CHKERRQ(ierr);
+                    }
+                }
+            }
+        }
+        if (!patch->save_operators && patch->cache_mb > 0) {
+            ierr = PetscMalloc4(patch->npatch, &patch->lruCached, patch->npatch, &patch->lruPrev,
+                                patch->npatch, &patch->lruNext, patch->npatch, &patch->lruBytes); CHKERRQ(ierr);
+            for ( PetscInt i = 0; i < patch->npatch; i++ ) patch->lruCached[i] = PETSC_FALSE;
+            patch->lruHead = patch->lruTail = -1;
+        }
+        if (patch->detect_changes) {
+            /* Changes are found by comparing element matrices. */
+            patch->cache_element_matrices = PETSC_TRUE;
+        }
+        if (patch->matrix_free) {
+            /* Shell operators are applied from element matrices. */
+            patch->cache_element_matrices = PETSC_TRUE;
+        }
+        if (patch->refactor_every > 1 && !patch->save_operators) {
+            /* Patches rebuilt in PCApply while lagging must not see
+             * the current coefficients through the kernel. */
+            patch->cache_element_matrices = PETSC_TRUE;
+        }
+        if (patch->cache_element_matrices) {
+            ierr = PCPatchCreateElementCache(pc); CHKERRQ(ierr);
+        }
+        {
+            const PetscInt *cellsArray;
+            PetscInt        numCells;
+            ierr = ISGetSize(patch->cells, &numCells); CHKERRQ(ierr);
+            ierr = ISGetIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+            for ( PetscInt i = 0; i < numCells; i++ ) {
+                patch->ncellNumbers = PetscMax(patch->ncellNumbers, cellsArray[i] + 1);
+            }
+            ierr = ISRestoreIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+            ierr = PetscCalloc1(patch->ncellNumbers, &patch->cellDirty); CHKERRQ(ierr);
+        }
+        if (patch->nthreads > 1) {
+            /* Threaded application needs every patch to be solved
+             * with the (thread safe) dense factors. */
+            PetscBool threadable = (patch->type == PC_PATCH_ADDITIVE && !patch->cellInterior) ? PETSC_TRUE : PETSC_FALSE;
+            for ( PetscInt i = pStart; i < pEnd; i++ ) {
+                PetscInt dof;
+                ierr = PetscSectionGetDof(patch->gtolCounts, i, &dof); CHKERRQ(ierr);
+                if (dof > 0 && patch->ksp[i - pStart]) threadable = PETSC_FALSE;
+            }
+            if (threadable) {
+                ierr = PCPatchCreateColouring(pc); CHKERRQ(ierr);
+            } else {
+                ierr = PetscInfo(pc, "Threaded patch application needs additive combination, dense patch solves and no condensation, running serially\n"); CHKERRQ(ierr);
             }
         }
         ierr = PetscLogEventEnd(PC_Patch_CreatePatches, pc, 0, 0, 0); CHKERRQ(ierr);
     }
 
+    if (pc->setupcalled && ++patch->nlagged < patch->refactor_every) {
+        /* Keep the operators and factors of an earlier PCSetUp.
+         * Patches that aren't saved are rebuilt in PCApply from the
+         * element matrices computed then, so every patch uses the
+         * operator of the last refactor.  The event counts the lags. */
+        ierr = PetscLogEventBegin(PC_Patch_Lag, pc, 0, 0, 0); CHKERRQ(ierr);
+        ierr = PetscInfo2(pc, "Lagging patch factors, %D of %D setups since the last refactor\n",
+                          patch->nlagged, patch->refactor_every); CHKERRQ(ierr);
+        ierr = PetscLogEventEnd(PC_Patch_Lag, pc, 0, 0, 0); CHKERRQ(ierr);
+        PetscFunctionReturn(0);
+    }
+    patch->nlagged = 0;
+    patch->nrefactor++;
+    ierr = PetscLogEventBegin(PC_Patch_Refactor, pc, 0, 0, 0); CHKERRQ(ierr);
+
     /* If desired, calculate weights for dof multiplicity */
 
-    if (patch->partition_of_unity) {
-        ierr = VecDuplicate(patch->localX, &patch->dof_weights); CHKERRQ(ierr);
-        ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, NULL); CHKERRQ(ierr);
-        for ( PetscInt i = 0; i < patch->npatch; i++ ) {
-            ierr = VecSet(patch->patchX[i], 1.0); CHKERRQ(ierr);
-            /* TODO: Do we need different scatters for X and Y? */
-            ierr = VecGetArray(patch->patchX[i], &patchX); CHKERRQ(ierr);
-            /* Apply bcs to patchX (zero entries) */
-            ierr = ISBlockGetLocalSize(patch->bcs[i], &numBcs); CHKERRQ(ierr);
-            ierr = ISBlockGetIndices(patch->bcs[i], &bcNodes); CHKERRQ(ierr);
-            for ( PetscInt j = 0; j < numBcs; j++ ) {
-                for ( PetscInt k = 0; k < patch->bs; k++ ) {
-                    const PetscInt idx = bcNodes[j]*patch->bs + k;
-                    patchX[idx] = 0;
+    if (patch->partition_of_unity && !patch->restricted && !patch->dof_weights) {
+        /* Counted locally, then summed into the global layout, which
+         * is what they weight. */
+        const PetscScalar *lweights = NULL;
+        PetscScalar       *weights  = NULL, *gweights = NULL;
+        PetscInt           numDofs;
+        ierr = MatCreateVecs(pc->pmat, &patch->dof_weights, NULL); CHKERRQ(ierr);
+        ierr = VecSet(patch->dof_weights, 0.0); CHKERRQ(ierr);
+        ierr = VecSet(patch->localY, 0.0); CHKERRQ(ierr);
+        ierr = PetscSectionGetStorageSize(patch->gtolCounts, &numDofs); CHKERRQ(ierr);
+        ierr = VecGetArray(patch->localY, &weights); CHKERRQ(ierr);
+        /* Each patch contributes one to every dof that isn't a patch BC. */
+        for ( PetscInt i = 0; i < numDofs*patch->bs; i++ ) {
+            if (patch->gatherIdx[i] >= 0) weights[patch->gatherIdx[i]] += 1.0;
+        }
+        if (patch->cellInterior) {
+            /* Condensed dofs are in every patch their cell is. */
+            const PetscInt  bs = patch->bs, ni = patch->ncellInterior*bs;
+            const PetscInt *cellsArray;
+            PetscInt        numCells;
+            ierr = ISGetSize(patch->cells, &numCells); CHKERRQ(ierr);
+            ierr = ISGetIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
+            for ( PetscInt k = 0; k < numCells; k++ ) {
+                const PetscInt *nodes = patch->cellNodeMap + cellsArray[k]*patch->nodesPerCell;
+                for ( PetscInt r = 0; r < ni; r++ ) {
+                    const PetscInt e = patch->condenseIdx[r];
+                    weights[nodes[e/bs]*bs + e%bs] += 1.0;
                 }
             }
-            ierr = ISBlockRestoreIndices(patch->bcs[i], &bcNodes); CHKERRQ(ierr);
-            ierr = VecRestoreArray(patch->patchX[i], &patchX); CHKERRQ(ierr);
-
-            ierr = PCPatch_ScatterLocal_Private(pc, i + pStart,
-                                                patch->patchX[i], patch->dof_weights,
-                                                ADD_VALUES, SCATTER_REVERSE); CHKERRQ(ierr);
+            ierr = ISRestoreIndices(patch->cells, &cellsArray); CHKERRQ(ierr);
         }
+        ierr = VecRestoreArray(patch->localY, &weights); CHKERRQ(ierr);
+        ierr = VecGetArrayRead(patch->localY, &lweights); CHKERRQ(ierr);
+        ierr = VecGetArray(patch->dof_weights, &gweights); CHKERRQ(ierr);
+        ierr = PetscSFReduceBegin(patch->defaultSF, patch->data_type, lweights, gweights, MPI_SUM); CHKERRQ(ierr);
+        ierr = PetscSFReduceEnd(patch->defaultSF, patch->data_type, lweights, gweights, MPI_SUM); CHKERRQ(ierr);
+        ierr = VecRestoreArray(patch->dof_weights, &gweights); CHKERRQ(ierr);
+        ierr = VecRestoreArrayRead(patch->localY, &lweights); CHKERRQ(ierr);
+        /* Leaves the dofs in no patch alone. */
         ierr = VecReciprocal(patch->dof_weights); CHKERRQ(ierr);
     }
 
+    for ( PetscInt k = 0; k < patch->ndirtyCells; k++ ) {
+        const PetscInt c = patch->dirtyCells[k];
+        if (c >= 0 && c < patch->ncellNumbers) patch->cellDirty[c] = PETSC_TRUE;
+    }
+    patch->ndirtyCells = 0;
+    if (patch->elementMats) {
+        /* Patch operators are gathered from these, both here and
+         * when rebuilt in PCApply. */
+        ierr = PCPatchComputeElementMatrices(pc); CHKERRQ(ierr);
+    }
+    ierr = PCPatchFindDirtyPatches_Private(pc); CHKERRQ(ierr);
+    for ( PetscInt i = 0; patch->lruCached && i < patch->npatch; i++ ) {
+        /* Cached factors of rebuilt patches are of the old operators. */
+        if (patch->lruCached[i] && patch->patchDirty[i]) {
+            ierr = PCPatchCacheEvict_Private(pc, i); CHKERRQ(ierr);
+        }
+    }
+    if (patch->denseOffsets && patch->share_factors) {
+        ierr = PCPatchFactorDenseShared_Private(pc); CHKERRQ(ierr);
+    } else if (patch->denseOffsets) {
+        /* Dense patches are always factored here, whether or not
+         * operators are saved.  Single precision factors are rounded
+         * patch by patch, so no double arena is needed. */
+        if (patch->precision == PC_PATCH_PRECISION_SINGLE) {
+            if (!patch->denseFactorsSingle) {
+                ierr = PetscMalloc1(patch->denseFactorSize, &patch->denseFactorsSingle); CHKERRQ(ierr);
+                ierr = PetscMalloc1((PetscInt64)patch->denseMaxDof*patch->denseMaxDof, &patch->denseScratch); CHKERRQ(ierr);
+            }
+        } else if (!patch->denseFactors) {
+            ierr = PetscMalloc1(patch->denseFactorSize, &patch->denseFactors); CHKERRQ(ierr);
+        }
+        for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+            if (patch->denseOffsets[i] < 0 || !patch->patchDirty[i]) continue;
+            ierr = PCPatchFactorDense_Private(pc, i); CHKERRQ(ierr);
+        }
+    }
+    if (patch->denseOffsets && patch->share_factors && patch->precision == PC_PATCH_PRECISION_SINGLE) {
+        ierr = PCPatchConvertFactorsSingle_Private(pc); CHKERRQ(ierr);
+    }
+    if (patch->fdmIdx) {
+        ierr = PCPatchSetUpFastDiagonalisation_Private(pc); CHKERRQ(ierr);
+    }
     if (patch->save_operators) {
         for ( PetscInt i = 0; i < patch->npatch; i++ ) {
-            ierr = MatZeroEntries(patch->mat[i]); CHKERRQ(ierr);
-            ierr = PCPatchComputeOperator(pc, patch->mat[i], i); CHKERRQ(ierr);
+            if (!patch->ksp[i] || !patch->patchDirty[i]) continue;
+            if (patch->fdmOffsets && patch->fdmOffsets[i] >= 0) continue;
+            if (!patch->matrix_free) {
+                ierr = MatZeroEntries(patch->mat[i]); CHKERRQ(ierr);
+                ierr = PCPatchComputeOperator(pc, patch->mat[i], i, PETSC_TRUE); CHKERRQ(ierr);
+            }
             ierr = KSPSetOperators(patch->ksp[i], patch->mat[i], patch->mat[i]); CHKERRQ(ierr);
         }
+        if (patch->type != PC_PATCH_ADDITIVE) {
+            for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+                if (patch->matrix_free && patch->ksp[i]) continue;
+                if (!patch->patchDirty[i]) continue;
+                ierr = MatZeroEntries(patch->matWithBcs[i]); CHKERRQ(ierr);
+                ierr = PCPatchComputeOperator(pc, patch->matWithBcs[i], i, PETSC_FALSE); CHKERRQ(ierr);
+            }
+        }
     }
+    ierr = PetscLogEventEnd(PC_Patch_Refactor, pc, 0, 0, 0); CHKERRQ(ierr);
     if (!pc->setupcalled) {
         for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+            if (!patch->ksp[i]) continue;
+            if (patch->matrix_free) {
+                /* Only the action and diagonal are available, so
+                 * default to CG with Jacobi (for SPD operators).  Types
+                 * already set, or given as options, win. */
+                PC      subpc;
+                KSPType ksptype;
+                PCType  pctype;
+                ierr = KSPGetType(patch->ksp[i], &ksptype); CHKERRQ(ierr);
+                if (!ksptype) {
+                    ierr = KSPSetType(patch->ksp[i], KSPCG); CHKERRQ(ierr);
+                }
+                ierr = KSPGetPC(patch->ksp[i], &subpc); CHKERRQ(ierr);
+                ierr = PCGetType(subpc, &pctype); CHKERRQ(ierr);
+                if (!pctype) {
+                    ierr = PCSetType(subpc, PCJACOBI); CHKERRQ(ierr);
+                }
+            }
             ierr = KSPSetFromOptions(patch->ksp[i]); CHKERRQ(ierr);
         }
     }
     PetscFunctionReturn(0);
 }
 
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchApplyPatch_Private"
+/*
+ * PCPatchApplyPatch_Private - Solve on a single patch and add the
+ * correction into the local solution.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . i - Index of the patch
+ * . owned - Are localX and localY the owned global arrays (for
+ *           interior patches), rather than the local vectors?
+ * . localX - The right hand side
+ * - localY - The solution
+ *
+ * Note:
+ *  For multiplicative combinations, localX is the current local
+ *  residual and is updated with the contribution of this patch's
+ *  correction on exit.
+ */
+static PetscErrorCode PCPatchApplyPatch_Private(PC pc, PetscInt i, PetscBool owned, PetscScalar *localX, PetscScalar *localY)
+{
+    PetscErrorCode     ierr;
+    PC_PATCH          *patch   = (PC_PATCH *)pc->data;
+    const PetscInt    *idx, *sidx;
+    const PetscInt    *perm    = NULL;
+    PetscScalar       *patchX, *patchY;
+    PetscInt           pStart, len, off, n;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = PetscSectionGetDof(patch->gtolCounts, i + pStart, &len); CHKERRQ(ierr);
+    ierr = PetscSectionGetOffset(patch->gtolCounts, i + pStart, &off); CHKERRQ(ierr);
+    n      = len*patch->bs;
+    idx    = (owned ? patch->ownedIdx : patch->gatherIdx) + off*patch->bs;
+    sidx   = patch->scatterIdx ? (owned ? patch->ownedScatterIdx : patch->scatterIdx) + off*patch->bs : idx;
+    patchX = patch->patchXArray + off*patch->bs;
+    patchY = patch->patchYArray + off*patch->bs;
+    if (!patch->ksp[i] && patch->densePerms) {
+        /* Shared factors want the canonical ordering. */
+        perm = patch->densePerms + off*patch->bs;
+    }
+    ierr = PetscLogEventBegin(PC_Patch_Scatter, pc, 0, 0, 0); CHKERRQ(ierr);
+    PCPatchGather_Private(n, idx, perm, localX, patchX);
+    ierr = PetscLogEventEnd(PC_Patch_Scatter, pc, 0, 0, 0); CHKERRQ(ierr);
+    if (patch->fdmOffsets && patch->fdmOffsets[i] >= 0) {
+        ierr = PetscLogEventBegin(PC_Patch_Solve, pc, 0, 0, 0); CHKERRQ(ierr);
+        ierr = PCPatchSolveFastDiagonalisation_Private(pc, i, patchX, patchY); CHKERRQ(ierr);
+        ierr = PetscLogEventEnd(PC_Patch_Solve, pc, 0, 0, 0); CHKERRQ(ierr);
+        goto scatterBack;
+    }
+    if (!patch->ksp[i]) {
+        ierr = PetscLogEventBegin(PC_Patch_Solve, pc, 0, 0, 0); CHKERRQ(ierr);
+        ierr = PCPatchSolveDense_Private(pc, i, patchX, patchY); CHKERRQ(ierr);
+        ierr = PetscLogEventEnd(PC_Patch_Solve, pc, 0, 0, 0); CHKERRQ(ierr);
+        goto scatterBack;
+    }
+    /* We wrote behind the Vec's back. */
+    ierr = PetscObjectStateIncrease((PetscObject)patch->patchX[i]); CHKERRQ(ierr);
+    if (patch->lruCached && patch->lruCached[i]) {
+        patch->lruHits++;
+    } else if (!patch->save_operators) {
+        Mat mat;
+        if (patch->lruCached) patch->lruMisses++;
+        /* Populate operator here. */
+        ierr = PCPatchGetOperator_Private(pc, i, PETSC_TRUE, &mat); CHKERRQ(ierr);
+        ierr = KSPSetOperators(patch->ksp[i], mat, mat);
+        /* Drop reference so the KSPSetOperators below will blow it away. */
+        ierr = MatDestroy(&mat); CHKERRQ(ierr);
+    }
+    ierr = PetscLogEventBegin(PC_Patch_Solve, pc, 0, 0, 0); CHKERRQ(ierr);
+    ierr = KSPSolve(patch->ksp[i], patch->patchX[i], patch->patchY[i]); CHKERRQ(ierr);
+    ierr = PetscLogEventEnd(PC_Patch_Solve, pc, 0, 0, 0); CHKERRQ(ierr);
+    if (patch->lruCached) {
+        /* Keep it around, within budget. */
+        ierr = PCPatchCacheInsert_Private(pc, i); CHKERRQ(ierr);
+    } else if (!patch->save_operators) {
+        PC pc;
+        ierr = KSPSetOperators(patch->ksp[i], NULL, NULL); CHKERRQ(ierr);
+        ierr = KSPGetPC(patch->ksp[i], &pc); CHKERRQ(ierr);
+        /* Destroy PC context too, otherwise the factored matrix hangs around. */
+        ierr = PCReset(pc); CHKERRQ(ierr);
+    }
+
+scatterBack:
+    /* XXX: pef thinks "do we not need to weight these
+     * contributions by the dof multiplicity?" */
+    ierr = PetscLogEventBegin(PC_Patch_Scatter, pc, 0, 0, 0); CHKERRQ(ierr);
+    PCPatchScatterAdd_Private(n, sidx, perm, patchY, localY);
+    ierr = PetscLogEventEnd(PC_Patch_Scatter, pc, 0, 0, 0); CHKERRQ(ierr);
+    if (patch->condenseData) {
+        const PetscScalar *u = patchY;
+        if (perm) {
+            /* Back to patch ordering, patchX is dead now. */
+            for ( PetscInt k = 0; k < n; k++ ) patchX[perm[k]] = patchY[k];
+            u = patchX;
+        }
+        ierr = PCPatchRecoverInterior_Private(pc, i, localX, u, localY); CHKERRQ(ierr);
+    }
+    if (patch->type != PC_PATCH_ADDITIVE) {
+        /* Update the local residual, r <- r - A_i y_i.  The
+         * correction vanishes on the patch boundary, so only rows of
+         * this patch change.  The boundary rows must be those of the
+         * unconstrained operator, so we can't use the solver's. */
+        Mat mat;
+        if (patch->save_operators) {
+            mat = patch->matWithBcs[i];
+        } else if (!patch->ksp[i]) {
+            ierr = PCPatchCreateMatrix(pc, i, &mat); CHKERRQ(ierr);
+            ierr = PCPatchComputeOperator(pc, mat, i, PETSC_FALSE); CHKERRQ(ierr);
+        } else {
+            ierr = PCPatchGetOperator_Private(pc, i, PETSC_FALSE, &mat); CHKERRQ(ierr);
+        }
+        if (perm) {
+            /* Back to patch ordering, patchX is dead now. */
+            for ( PetscInt k = 0; k < n; k++ ) patchX[perm[k]] = patchY[k];
+            ierr = PetscObjectStateIncrease((PetscObject)patch->patchX[i]); CHKERRQ(ierr);
+            ierr = MatMult(mat, patch->patchX[i], patch->patchY[i]); CHKERRQ(ierr);
+            PCPatchScatterAXPYAll_Private(n, -1.0, idx, patchY, localX);
+        } else {
+            ierr = PetscObjectStateIncrease((PetscObject)patch->patchY[i]); CHKERRQ(ierr);
+            /* patchX is dead now, reuse it for A_i y_i. */
+            ierr = MatMult(mat, patch->patchY[i], patch->patchX[i]); CHKERRQ(ierr);
+            PCPatchScatterAXPYAll_Private(n, -1.0, idx, patchX, localX);
+        }
+        if (!patch->save_operators) {
+            ierr = MatDestroy(&mat); CHKERRQ(ierr);
+        }
+    }
+    PetscFunctionReturn(0);
+}
+
+#undef __FUNCT__
+#define __FUNCT__ "PCPatchApplyColoured_Private"
+/*
+ * PCPatchApplyColoured_Private - Additively apply all patches using
+ * threads, one colour at a time.
+ *
+ * Input Parameters:
+ * + pc - The patch PC
+ * . owned - Apply the interior patches to the owned global arrays, or
+ *           the rest to the local vectors?
+ * . localX - The right hand side
+ * - localY - The solution
+ *
+ * Note:
+ *  Only raw arrays and LAPACK are touched inside the parallel region,
+ *  since PETSc objects are not thread safe.  Patches of one colour
+ *  share no dofs, so the updates of localY need no atomics, and each
+ *  patch has its own slice of the work space.
+ */
+static PetscErrorCode PCPatchApplyColoured_Private(PC pc, PetscBool owned, const PetscScalar *localX, PetscScalar *localY)
+{
+    PetscErrorCode     ierr;
+    PC_PATCH          *patch    = (PC_PATCH *)pc->data;
+    const PetscInt     bs       = patch->bs;
+    const PetscInt    *table    = owned ? patch->ownedIdx : patch->gatherIdx;
+    const PetscInt    *stable   = patch->scatterIdx ? (owned ? patch->ownedScatterIdx : patch->scatterIdx) : table;
+    const PetscInt    *colourPatches;
+    PetscInt          *offs     = NULL;
+    PetscInt           pStart, ncolour;
+    PetscBLASInt       failed   = 0;
+
+    PetscFunctionBegin;
+    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, NULL); CHKERRQ(ierr);
+    ierr = PetscSectionGetChart(patch->colourCounts, NULL, &ncolour); CHKERRQ(ierr);
+    /* Pull out everything we need from PETSc objects up front. */
+    ierr = PetscMalloc1(patch->npatch + 1, &offs); CHKERRQ(ierr);
+    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+        ierr = PetscSectionGetOffset(patch->gtolCounts, i + pStart, &offs[i]); CHKERRQ(ierr);
+    }
+    ierr = PetscSectionGetStorageSize(patch->gtolCounts, &offs[patch->npatch]); CHKERRQ(ierr);
+    ierr = ISGetIndices(patch->colourPatches, &colourPatches); CHKERRQ(ierr);
+
+    ierr = PetscLogEventBegin(PC_Patch_Solve, pc, 0, 0, 0); CHKERRQ(ierr);
+    for ( PetscInt c = 0; c < ncolour; c++ ) {
+        PetscInt cdof, coff;
+        ierr = PetscSectionGetDof(patch->colourCounts, c, &cdof); CHKERRQ(ierr);
+        ierr = PetscSectionGetOffset(patch->colourCounts, c, &coff); CHKERRQ(ierr);
+#if defined(_OPENMP)
+#pragma omp parallel for schedule(dynamic) num_threads(patch->nthreads) reduction(max:failed)
+#endif
+        for ( PetscInt k = coff; k < coff + cdof; k++ ) {
+            const PetscInt  i   = colourPatches[k];
+            const PetscInt  off = offs[i]*bs;
+            const PetscInt *idx = table + off;
+            const PetscInt *perm = patch->densePerms ? patch->densePerms + off : NULL;
+            const PetscInt  rep = patch->denseShared ? patch->denseShared[i] : i;
+            PetscScalar    *w   = patch->patchYArray + off;
+            PetscBLASInt    n   = (PetscBLASInt)((offs[i + 1] - offs[i])*bs), one = 1, info;
+            if ((patch->interior && patch->interior[i]) != owned) continue;
+            PCPatchGather_Private(n, idx, perm, localX, w);
+            if (patch->denseFactorsSingle) {
+                PCPatchLUSolveSingle_Private(n, patch->denseFactorsSingle + patch->denseOffsets[i],
+                                             patch->densePivots + offs[rep]*bs, w);
+            } else {
+                LAPACKgetrs_("N", &n, &one, patch->denseFactors + patch->denseOffsets[i],
+                             &n, patch->densePivots + offs[rep]*bs, w, &n, &info);
+                if (info) failed = PetscMax(failed, (PetscBLASInt)(i + 1));
+            }
+            PCPatchScatterAdd_Private(n, stable + off, perm, w, localY);
+        }
+    }
+    ierr = PetscLogEventEnd(PC_Patch_Solve, pc, 0, 0, 0); CHKERRQ(ierr);
+
+    ierr = ISRestoreIndices(patch->colourPatches, &colourPatches); CHKERRQ(ierr);
+    ierr = PetscFree(offs); CHKERRQ(ierr);
+    if (failed) {
+        SETERRQ1(PETSC_COMM_SELF, PETSC_ERR_LIB, "Error in LAPACK getrs on patch %D\n", (PetscInt)(failed - 1));
+    }
+    PetscFunctionReturn(0);
+}
+
 #undef __FUNCT__
 #define __FUNCT__ "PCApply_PATCH"
 static PetscErrorCode PCApply_PATCH(PC pc, Vec x, Vec y)
@@ -981,86 +4510,67 @@ static PetscErrorCode PCApply_PATCH(PC pc, Vec x, Vec y)
     PetscScalar       *localX  = NULL;
     PetscScalar       *localY  = NULL;
     PetscScalar       *globalY = NULL;
-    PetscScalar       *patchX  = NULL;
     const PetscInt    *bcNodes = NULL;
-    PetscInt           pStart, numBcs, size;
-    
+    PetscInt           numBcs, size;
+
     PetscFunctionBegin;
 
     ierr = PetscLogEventBegin(PC_Patch_Apply, pc, 0, 0, 0); CHKERRQ(ierr);
     ierr = PetscOptionsPushGetViewerOff(PETSC_TRUE); CHKERRQ(ierr);
+    ierr = VecSet(patch->localY, 0.0); CHKERRQ(ierr);
+    ierr = VecSet(y, 0.0); CHKERRQ(ierr);
     ierr = VecGetArrayRead(x, &globalX); CHKERRQ(ierr);
     ierr = VecGetArray(patch->localX, &localX); CHKERRQ(ierr);
+    ierr = VecGetArray(y, &globalY); CHKERRQ(ierr);
     /* Scatter from global space into overlapped local spaces */
     ierr = PetscSFBcastBegin(patch->defaultSF, patch->data_type, globalX, localX); CHKERRQ(ierr);
+    if (patch->ninterior) {
+        /* Interior patches only see owned dofs, so they can be solved
+         * straight from x into y while the halo is in flight.  Their
+         * corrections then need no communication at all.  Additive
+         * patches don't modify the right hand side. */
+        if (patch->colourPatches) {
+            ierr = PCPatchApplyColoured_Private(pc, PETSC_TRUE, globalX, globalY); CHKERRQ(ierr);
+        } else {
+            for ( PetscInt k = 0; k < patch->npatch; k++ ) {
+                const PetscInt i = patch->patchOrder ? patch->patchOrder[k] : k;
+                if (!patch->interior[i]) continue;
+                ierr = PCPatchApplyPatch_Private(pc, i, PETSC_TRUE, (PetscScalar *)globalX, globalY); CHKERRQ(ierr);
+            }
+        }
+    }
     ierr = PetscSFBcastEnd(patch->defaultSF, patch->data_type, globalX, localX); CHKERRQ(ierr);
     ierr = VecRestoreArrayRead(x, &globalX); CHKERRQ(ierr);
-    ierr = VecRestoreArray(patch->localX, &localX); CHKERRQ(ierr);
-    ierr = VecSet(patch->localY, 0.0); CHKERRQ(ierr);
-    ierr = PetscSectionGetChart(patch->gtolCounts, &pStart, NULL); CHKERRQ(ierr);
-    for ( PetscInt i = 0; i < patch->npatch; i++ ) {
-        PetscInt start, len;
-        ierr = PetscSectionGetDof(patch->gtolCounts, i + pStart, &len); CHKERRQ(ierr);
-        ierr = PetscSectionGetOffset(patch->gtolCounts, i + pStart, &start); CHKERRQ(ierr);
-        if ( len <= 0 ) {
-            /* TODO: Squash out these guys in the setup as well. */
-            continue;
-        }
-        ierr = PCPatch_ScatterLocal_Private(pc, i + pStart,
-                                            patch->localX, patch->patchX[i],
-                                            INSERT_VALUES,
-                                            SCATTER_FORWARD); CHKERRQ(ierr);
-        /* TODO: Do we need different scatters for X and Y? */
-        ierr = VecGetArray(patch->patchX[i], &patchX); CHKERRQ(ierr);
-        /* Apply bcs to patchX (zero entries) */
-        ierr = ISBlockGetLocalSize(patch->bcs[i], &numBcs); CHKERRQ(ierr);
-        ierr = ISBlockGetIndices(patch->bcs[i], &bcNodes); CHKERRQ(ierr);
-        for ( PetscInt j = 0; j < numBcs; j++ ) {
-            for ( PetscInt k = 0; k < patch->bs; k++ ) {
-                const PetscInt idx = bcNodes[j]*patch->bs + k;
-                patchX[idx] = 0;
-            }
+    if (patch->condenseData) {
+        ierr = PCPatchCondenseRhs_Private(pc, localX); CHKERRQ(ierr);
+    }
+    ierr = VecGetArray(patch->localY, &localY); CHKERRQ(ierr);
+    if (patch->colourPatches) {
+        ierr = PCPatchApplyColoured_Private(pc, PETSC_FALSE, localX, localY); CHKERRQ(ierr);
+    } else {
+        for ( PetscInt k = 0; k < patch->npatch; k++ ) {
+            const PetscInt i = patch->patchOrder ? patch->patchOrder[k] : k;
+            if (patch->interior && patch->interior[i]) continue;
+            ierr = PCPatchApplyPatch_Private(pc, i, PETSC_FALSE, localX, localY); CHKERRQ(ierr);
         }
-        ierr = ISBlockRestoreIndices(patch->bcs[i], &bcNodes); CHKERRQ(ierr);
-        ierr = VecRestoreArray(patch->patchX[i], &patchX); CHKERRQ(ierr);
-        if (!patch->save_operators) {
-            Mat mat;
-            ierr = PCPatchCreateMatrix(pc, patch->patchX[i], patch->patchY[i], &mat); CHKERRQ(ierr);
-            /* Populate operator here. */
-            ierr = PCPatchComputeOperator(pc, mat, i); CHKERRQ(ierr);
-            ierr = KSPSetOperators(patch->ksp[i], mat, mat);
-            /* Drop reference so the KSPSetOperators below will blow it away. */
-            ierr = MatDestroy(&mat); CHKERRQ(ierr);
+    }
+    if (patch->type == PC_PATCH_SYMMETRIC) {
+        /* And back again. */
+        for ( PetscInt k = patch->npatch - 1; k >= 0; k-- ) {
+            const PetscInt i = patch->patchOrder ? patch->patchOrder[k] : k;
+            ierr = PCPatchApplyPatch_Private(pc, i, PETSC_FALSE, localX, localY); CHKERRQ(ierr);
         }
-        ierr = PetscLogEventBegin(PC_Patch_Solve, pc, 0, 0, 0); CHKERRQ(ierr);
-        ierr = KSPSolve(patch->ksp[i], patch->patchX[i], patch->patchY[i]); CHKERRQ(ierr);
-        ierr = PetscLogEventEnd(PC_Patch_Solve, pc, 0, 0, 0); CHKERRQ(ierr);
-        if (!patch->save_operators) {
-            PC pc;
-            ierr = KSPSetOperators(patch->ksp[i], NULL, NULL); CHKERRQ(ierr);
-            ierr = KSPGetPC(patch->ksp[i], &pc); CHKERRQ(ierr);
-            /* Destroy PC context too, otherwise the factored matrix hangs around. */
-            ierr = PCReset(pc); CHKERRQ(ierr);
-        }
-
-        /* XXX: This bit needs changed for multiplicative combinations. */
-        /* XXX: pef thinks "do we not need to weight these
-         * contributions by the dof multiplicity?" */
-        ierr = PCPatch_ScatterLocal_Private(pc, i + pStart,
-                                            patch->patchY[i], patch->localY,
-                                            ADD_VALUES, SCATTER_REVERSE); CHKERRQ(ierr);
-    }
-    /* Now patch->localY contains the solution of the patch solves, so
-     * we need to combine them all.  This hardcodes an ADDITIVE
-     * combination right now.  If one wanted multiplicative, the
-     * scatter/gather stuff would have to be reworked a bit. */
-    ierr = VecSet(y, 0.0); CHKERRQ(ierr);
+    }
+    ierr = VecRestoreArray(patch->localY, &localY); CHKERRQ(ierr);
+    ierr = VecRestoreArray(patch->localX, &localX); CHKERRQ(ierr);
+    /* Now patch->localY contains the sum of the remaining patch
+     * corrections, so we need to combine them all with those already
+     * in y.  Across processes the combination is always additive. */
     ierr = VecGetArrayRead(patch->localY, (const PetscScalar **)&localY); CHKERRQ(ierr);
-    ierr = VecGetArray(y, &globalY); CHKERRQ(ierr);
     ierr = PetscSFReduceBegin(patch->defaultSF, patch->data_type, localY, globalY, MPI_SUM); CHKERRQ(ierr);
     ierr = PetscSFReduceEnd(patch->defaultSF, patch->data_type, localY, globalY, MPI_SUM); CHKERRQ(ierr);
     ierr = VecRestoreArrayRead(patch->localY, (const PetscScalar **)&localY); CHKERRQ(ierr);
-    if (patch->partition_of_unity) {
+    if (patch->dof_weights) {
         ierr = VecRestoreArray(y, &globalY); CHKERRQ(ierr);
         ierr = VecPointwiseMult(y, y, patch->dof_weights); CHKERRQ(ierr);
         ierr = VecGetArray(y, &globalY); CHKERRQ(ierr);
@@ -1099,6 +4609,7 @@ static PetscErrorCode PCSetUpOnBlocks_PATCH(PC pc)
   PetscFunctionBegin;
   PetscFunctionReturn(0);
   for (i=0; i<patch->npatch; i++) {
+    if (!patch->ksp[i]) continue;
     ierr = KSPSetUp(patch->ksp[i]); CHKERRQ(ierr);
     ierr = KSPGetConvergedReason(patch->ksp[i], &reason); CHKERRQ(ierr);
     if (reason == KSP_DIVERGED_PCSETUP_FAILED) {
@@ -1116,9 +4627,11 @@ static PetscErrorCode PCSetFromOptions_PATCH(PetscOptionItems *PetscOptionsObjec
     PetscErrorCode  ierr;
     PetscBool       flg;
     char            sub_mat_type[256];
+    PetscInt        nthreads, refactor_every;
+    PCPatchPrecision precision;
 
     PetscFunctionBegin;
-    ierr = PetscOptionsHead(PetscOptionsObject, "Vertex-patch Additive Schwarz options"); CHKERRQ(ierr);
+    ierr = PetscOptionsHead(PetscOptionsObject, "Vertex-patch Schwarz options"); CHKERRQ(ierr);
 
     ierr = PetscOptionsBool("-pc_patch_save_operators", "Store all patch operators for lifetime of PC?",
                             "PCPatchSetSaveOperators", patch->save_operators, &patch->save_operators, &flg); CHKERRQ(ierr);
@@ -1126,6 +4639,57 @@ static PetscErrorCode PCSetFromOptions_PATCH(PetscOptionItems *PetscOptionsObjec
     ierr = PetscOptionsBool("-pc_patch_partition_of_unity", "Weight contributions by dof multiplicity?",
                             "PCPatchSetPartitionOfUnity", patch->partition_of_unity, &patch->partition_of_unity, &flg); CHKERRQ(ierr);
 
+    ierr = PetscOptionsEnum("-pc_patch_type", "How to combine the patch corrections", "PCPatchSetType",
+                            PCPatchTypes, (PetscEnum)patch->type, (PetscEnum *)&patch->type, &flg); CHKERRQ(ierr);
+
+    ierr = PetscOptionsEnum("-pc_patch_solver_type", "How to solve the patch problems", "PCPatchSetSolverType",
+                            PCPatchSolverTypes, (PetscEnum)patch->solver_type, (PetscEnum *)&patch->solver_type, &flg); CHKERRQ(ierr);
+
+    ierr = PetscOptionsInt("-pc_patch_dense_max_size", "Largest patch (in dofs) factored densely, larger ones use a KSP",
+                           "PCPatchSetDenseMaxSize", patch->dense_max_size, &patch->dense_max_size, &flg); CHKERRQ(ierr);
+
+    ierr = PetscOptionsEnum("-pc_patch_precision", "Precision dense patch factors are stored in", "PCPatchSetPrecision",
+                            PCPatchPrecisions, (PetscEnum)patch->precision, (PetscEnum *)&precision, &flg); CHKERRQ(ierr);
+    if (flg) {
+        ierr = PCPatchSetPrecision(pc, precision); CHKERRQ(ierr);
+    }
+
+    ierr = PetscOptionsBool("-pc_patch_matrix_free", "Apply KSP patch operators matrix-free from element matrices?",
+                            "PCPatchSetMatrixFree", patch->matrix_free, &patch->matrix_free, &flg); CHKERRQ(ierr);
+
+    ierr = PetscOptionsBool("-pc_patch_dense_share_factors", "Share one LU factorisation among dense patches with equivalent operators?",
+                            "PCPatchSetShareFactors", patch->share_factors, &patch->share_factors, &flg); CHKERRQ(ierr);
+
+    ierr = PetscOptionsBool("-pc_patch_condense", "Statically condense cell interior dofs out of the patches (additive only)?",
+                            "PCPatchSetCondense", patch->condense, &patch->condense, &flg); CHKERRQ(ierr);
+
+    ierr = PetscOptionsReal("-pc_patch_cache_mb", "Without saved operators, keep the most recently used patch factors within this many MB",
+                            "PCPatchSetCacheMB", patch->cache_mb, &patch->cache_mb, &flg); CHKERRQ(ierr);
+
+    ierr = PetscOptionsInt("-pc_patch_refactor_every", "Rebuild saved patch operators and factors every this many setups",
+                           "PCPatchSetRefactorEvery", patch->refactor_every, &refactor_every, &flg); CHKERRQ(ierr);
+    if (flg) {
+        ierr = PCPatchSetRefactorEvery(pc, refactor_every); CHKERRQ(ierr);
+    }
+
+    ierr = PetscOptionsBool("-pc_patch_detect_changes", "Only rebuild patches whose element matrices changed since the last setup?",
+                            "PCPatchSetDetectChanges", patch->detect_changes, &patch->detect_changes, &flg); CHKERRQ(ierr);
+
+    ierr = PetscOptionsBool("-pc_patch_restricted", "Take each dof's correction from a single patch (restricted additive Schwarz)?",
+                            "PCPatchSetRestricted", patch->restricted, &patch->restricted, &flg); CHKERRQ(ierr);
+
+    ierr = PetscOptionsBool("-pc_patch_reorder", "Apply the patches in RCM order, and number their dofs for small bandwidth?",
+                            "PCPatchSetReorder", patch->reorder, &patch->reorder, &flg); CHKERRQ(ierr);
+
+    ierr = PetscOptionsBool("-pc_patch_cache_element_matrices", "Compute each cell's element matrix once and assemble patches from them?",
+                            "PCPatchSetCacheElementMatrices", patch->cache_element_matrices, &patch->cache_element_matrices, &flg); CHKERRQ(ierr);
+
+    ierr = PetscOptionsInt("-pc_patch_num_threads", "Threads used to apply the patches (needs dense solver)",
+                           "PCPatchSetNumThreads", patch->nthreads, &nthreads, &flg); CHKERRQ(ierr);
+    if (flg) {
+        ierr = PCPatchSetNumThreads(pc, nthreads); CHKERRQ(ierr);
+    }
+
     ierr = PetscOptionsFList("-pc_patch_sub_mat_type", "Matrix type for patch solves", "PCPatchSetSubMatType",MatList, NULL, sub_mat_type, 256, &flg); CHKERRQ(ierr);
     if (flg) {
         ierr = PCPatchSetSubMatType(pc, sub_mat_type); CHKERRQ(ierr);
@@ -1151,12 +4715,81 @@ static PetscErrorCode PCView_PATCH(PC pc, PetscViewer viewer)
         PetscFunctionReturn(0);
     }
     ierr = PetscViewerASCIIPushTab(viewer); CHKERRQ(ierr);
-    ierr = PetscViewerASCIIPrintf(viewer, "Vertex-patch Additive Schwarz with %d patches\n", patch->npatch); CHKERRQ(ierr);
+    ierr = PetscViewerASCIIPrintf(viewer, "Vertex-patch Schwarz (%s) with %d patches\n", PCPatchTypes[patch->type], patch->npatch); CHKERRQ(ierr);
+    if (patch->patchCost && patch->costMean > 0) {
+        ierr = PetscViewerASCIIPrintf(viewer, "Estimated patch work (sum of n^3) per process: min %g, max %g, imbalance (max/mean) %g\n",
+                                      (double)patch->costMin, (double)patch->costMax,
+                                      (double)(patch->costMax/patch->costMean)); CHKERRQ(ierr);
+    }
+    if (patch->ntruncated) {
+        ierr = PetscViewerASCIIPrintf(viewer, "WARNING: %D patches (over all processes) truncated by the partition, the mesh needs a vertex overlap\n",
+                                      patch->ntruncated); CHKERRQ(ierr);
+    }
     if (!patch->save_operators) {
         ierr = PetscViewerASCIIPrintf(viewer, "Not saving patch operators (rebuilt every PCApply)\n"); CHKERRQ(ierr);
     } else {
         ierr = PetscViewerASCIIPrintf(viewer, "Saving patch operators (rebuilt every PCSetUp)\n"); CHKERRQ(ierr);
     }
+    if (patch->matrix_free) {
+        ierr = PetscViewerASCIIPrintf(viewer, "Applying KSP patch operators matrix-free\n"); CHKERRQ(ierr);
+    }
+    if (patch->fdmOffsets) {
+        ierr = PetscViewerASCIIPrintf(viewer, "Fast diagonalisation on %D of %D patches, others use KSP\n",
+                                      patch->nfdm, patch->npatch); CHKERRQ(ierr);
+    }
+    if (patch->elementMats) {
+        ierr = PetscViewerASCIIPrintf(viewer, "Assembling patches from %D cached element matrices\n", patch->nelementSlots); CHKERRQ(ierr);
+    }
+    if (patch->lruCached) {
+        ierr = PetscViewerASCIIPrintf(viewer, "Caching patch factors within %g MB: %D kept using %g MB, %D hits, %D misses\n",
+                                      (double)patch->cache_mb, patch->ncached, (double)(patch->lruTotal/(1024.0*1024.0)),
+                                      patch->lruHits, patch->lruMisses); CHKERRQ(ierr);
+    }
+    if (patch->refactor_every > 1) {
+        ierr = PetscViewerASCIIPrintf(viewer, "Refactoring every %D setups: %D refactors, lagged for the last %D\n",
+                                      patch->refactor_every, patch->nrefactor, patch->nlagged); CHKERRQ(ierr);
+    }
+    if (patch->patchDirty) {
+        ierr = PetscViewerASCIIPrintf(viewer, "Rebuilt %D of %D patches at the last setup%s\n", patch->nrebuilt, patch->npatch,
+                                      patch->detect_changes ? " (detecting changed elements)" : ""); CHKERRQ(ierr);
+    }
+    if (patch->scatterIdx) {
+        ierr = PetscViewerASCIIPrintf(viewer, "Restricted: each dof takes its correction from one patch\n"); CHKERRQ(ierr);
+    } else if (patch->dof_weights) {
+        ierr = PetscViewerASCIIPrintf(viewer, "Weighting corrections by dof multiplicity\n"); CHKERRQ(ierr);
+    }
+    if (patch->patchOrder) {
+        ierr = PetscViewerASCIIPrintf(viewer, "Patches and their dofs in RCM order\n"); CHKERRQ(ierr);
+    }
+    if (patch->cellInterior) {
+        ierr = PetscViewerASCIIPrintf(viewer, "Condensing %D of %D nodes per cell out of the patches\n",
+                                      patch->ncellInterior, patch->nodesPerCell); CHKERRQ(ierr);
+    }
+    if (patch->colourCounts) {
+        PetscInt ncolour;
+        ierr = PetscSectionGetChart(patch->colourCounts, NULL, &ncolour); CHKERRQ(ierr);
+        ierr = PetscViewerASCIIPrintf(viewer, "Applying patches with %D threads in %D colours\n", patch->nthreads, ncolour); CHKERRQ(ierr);
+    }
+    if (patch->denseOffsets) {
+        PetscInt ndense = 0;
+        for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+            if (patch->denseOffsets[i] >= 0) ndense++;
+        }
+        ierr = PetscViewerASCIIPrintf(viewer, "Dense LU patch solver on %D of %D patches\n",
+                                      ndense, patch->npatch); CHKERRQ(ierr);
+        if (patch->share_factors) {
+            PetscInt nshared = 0;
+            for ( PetscInt i = 0; i < patch->npatch; i++ ) {
+                if (patch->denseShared && patch->denseOffsets[i] >= 0 && patch->denseShared[i] != i) nshared++;
+            }
+            ierr = PetscViewerASCIIPrintf(viewer, "Sharing %D unique factorisations, %D of %D dense patches use another's\n",
+                                          patch->nuniqueFactors, nshared, ndense); CHKERRQ(ierr);
+        }
+        if (patch->denseFactorsSingle) {
+            const double saved = (double)patch->denseFactorSize*(sizeof(PetscScalar) - sizeof(float))/(1024.0*1024.0);
+            ierr = PetscViewerASCIIPrintf(viewer, "Factors stored in single precision, saving %g MB\n", saved); CHKERRQ(ierr);
+        }
+    }
     ierr = PetscViewerASCIIPrintf(viewer, "DM used to define patches:\n"); CHKERRQ(ierr);
     ierr = PetscViewerASCIIPushTab(viewer); CHKERRQ(ierr);
     if (patch->dm) {
@@ -1168,10 +4801,14 @@ static PetscErrorCode PCView_PATCH(PC pc, PetscViewer viewer)
     ierr = PetscViewerASCIIPrintf(viewer, "KSP on patches (all same):\n"); CHKERRQ(ierr);
     
     if (patch->ksp) {
+        KSP ksp = NULL;
+        for ( PetscInt i = 0; i < patch->npatch && !ksp; i++ ) {
+            ksp = patch->ksp[i];
+        }
         ierr = PetscViewerGetSubViewer(viewer, PETSC_COMM_SELF, &sviewer); CHKERRQ(ierr);
-        if (!rank) {
+        if (!rank && ksp) {
             ierr = PetscViewerASCIIPushTab(sviewer); CHKERRQ(ierr);
-            ierr = KSPView(patch->ksp[0], sviewer); CHKERRQ(ierr);
+            ierr = KSPView(ksp, sviewer); CHKERRQ(ierr);
             ierr = PetscViewerASCIIPopTab(sviewer); CHKERRQ(ierr);
         }
         ierr = PetscViewerRestoreSubViewer(viewer, PETSC_COMM_SELF, &sviewer); CHKERRQ(ierr);
@@ -1198,6 +4835,11 @@ PETSC_EXTERN PetscErrorCode PCCreate_PATCH(PC pc)
     ierr = PetscNewLog(pc, &patch); CHKERRQ(ierr);
 
     patch->sub_mat_type      = NULL;
+    patch->type              = PC_PATCH_ADDITIVE;
+    patch->solver_type       = PC_PATCH_SOLVER_KSP;
+    patch->dense_max_size    = PETSC_MAX_INT;
+    patch->nthreads          = 1;
+    patch->refactor_every    = 1;
     pc->data                 = (void *)patch;
     pc->ops->apply           = PCApply_PATCH;
     pc->ops->applytranspose  = 0; /* PCApplyTranspose_PATCH; */
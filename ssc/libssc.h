@@ -1,6 +1,9 @@
 #ifndef _PC_PATCH_H
 #define _PC_PATCH_H
 #include <petsc.h>
+typedef enum {PC_PATCH_ADDITIVE, PC_PATCH_MULTIPLICATIVE, PC_PATCH_SYMMETRIC} PCPatchType;
+typedef enum {PC_PATCH_SOLVER_KSP, PC_PATCH_SOLVER_DENSE, PC_PATCH_SOLVER_FDM} PCPatchSolverType;
+typedef enum {PC_PATCH_PRECISION_DOUBLE, PC_PATCH_PRECISION_SINGLE} PCPatchPrecision;
 PETSC_EXTERN PetscErrorCode PCPatchInitializePackage(void);
 PETSC_EXTERN PetscErrorCode PCCreate_PATCH(PC);
 PETSC_EXTERN PetscErrorCode PCPatchSetDMPlex(PC, DM);
@@ -9,4 +12,21 @@ PETSC_EXTERN PetscErrorCode PCPatchSetCellNumbering(PC, PetscSection);
 PETSC_EXTERN PetscErrorCode PCPatchSetDiscretisationInfo(PC, PetscSection,PetscInt,PetscInt,const PetscInt *,PetscInt,const PetscInt *);
 PETSC_EXTERN PetscErrorCode PCPatchSetComputeOperator(PC, PetscErrorCode (*)(PC,Mat,PetscInt,const PetscInt *,PetscInt,const PetscInt *,void *),
                                                       void *);
+PETSC_EXTERN PetscErrorCode PCPatchSetComputeOperatorKernel(PC, void (*)(void), PetscInt, void **);
+PETSC_EXTERN PetscErrorCode PCPatchSetType(PC, PCPatchType);
+PETSC_EXTERN PetscErrorCode PCPatchSetSolverType(PC, PCPatchSolverType);
+PETSC_EXTERN PetscErrorCode PCPatchSetDenseMaxSize(PC, PetscInt);
+PETSC_EXTERN PetscErrorCode PCPatchSetShareFactors(PC, PetscBool);
+PETSC_EXTERN PetscErrorCode PCPatchSetMatrixFree(PC, PetscBool);
+PETSC_EXTERN PetscErrorCode PCPatchSetDofCoordinates(PC, PetscInt, PetscInt, const PetscReal *);
+PETSC_EXTERN PetscErrorCode PCPatchSetPrecision(PC, PCPatchPrecision);
+PETSC_EXTERN PetscErrorCode PCPatchSetNumThreads(PC, PetscInt);
+PETSC_EXTERN PetscErrorCode PCPatchSetCacheElementMatrices(PC, PetscBool);
+PETSC_EXTERN PetscErrorCode PCPatchSetCondense(PC, PetscBool);
+PETSC_EXTERN PetscErrorCode PCPatchSetDetectChanges(PC, PetscBool);
+PETSC_EXTERN PetscErrorCode PCPatchSetRefactorEvery(PC, PetscInt);
+PETSC_EXTERN PetscErrorCode PCPatchSetCacheMB(PC, PetscReal);
+PETSC_EXTERN PetscErrorCode PCPatchSetReorder(PC, PetscBool);
+PETSC_EXTERN PetscErrorCode PCPatchSetRestricted(PC, PetscBool);
+PETSC_EXTERN PetscErrorCode PCPatchMarkDirtyCells(PC, PetscInt, const PetscInt *);
 #endif
@@ -1,4 +1,5 @@
 from __future__ import absolute_import
+import ctypes
 import numpy
 import operator
 
@@ -87,10 +88,21 @@ class DenseMat(pyop2.Mat):
 class JITModule(seq.JITModule):
     @classmethod
     def _cache_key(cls, *args, **kwargs):
-        # No caching
+        # No caching: the generated code (local MatSetValues, see
+        # MatArg) differs from PyOP2's, and a cached module would keep
+        # the first form's mesh and coefficients alive.
         return None
 
 
+# Compiled patch kernels and their coefficient maps, by form signature.
+# Only the function is kept (it holds on to its library), the data it
+# runs on is bound afresh for each form in setup_patch_pc.  This saves
+# TSFC and code generation on repeated setups within a process; a new
+# process regenerates the code, but PyOP2 finds the compiled library in
+# its disk cache, keyed by that code.
+_matrix_funptr_cache = {}
+
+
 def matrix_funptr(form):
     from firedrake.tsfc_interface import compile_form
     test, trial = map(operator.methodcaller("function_space"), form.arguments())
@@ -98,6 +110,11 @@ def matrix_funptr(form):
         raise NotImplementedError("Only for matching test and trial spaces")
     if len(test) != 1:
         raise NotImplementedError("Not for mixed spaces")
+    key = form.signature()
+    try:
+        return _matrix_funptr_cache[key]
+    except KeyError:
+        pass
     kernels = compile_form(form, "subspace_form")
     if len(kernels) != 1:
         raise NotImplementedError("Only for single integral")
@@ -135,12 +152,13 @@ def matrix_funptr(form):
 
     iterset = op2.Subset(mesh.cell_set, [0])
     mod = JITModule(kinfo.kernel, iterset, *args)
-    return mod._fun, kinfo
+    _matrix_funptr_cache[key] = (mod._fun, kinfo.coefficient_map)
+    return _matrix_funptr_cache[key]
 
 
 def setup_patch_pc(patch, J, bcs):
     patch = PatchPC.PC.cast(patch)
-    funptr, kinfo = matrix_funptr(J)
+    funptr, coefficient_map = matrix_funptr(J)
     V, _ = map(operator.methodcaller("function_space"), J.arguments())
     mesh = V.ufl_domain()
 
@@ -150,7 +168,7 @@ def setup_patch_pc(patch, J, bcs):
         bc_nodes = numpy.empty(0, dtype=numpy.int32)
 
     op_coeffs = [mesh.coordinates]
-    for n in kinfo.coefficient_map:
+    for n in coefficient_map:
         op_coeffs.append(J.coefficients()[n])
 
     op_args = []
@@ -161,15 +179,24 @@ def setup_patch_pc(patch, J, bcs):
             if c_map is not None:
                 op_args.append(c_map._values.ctypes.data)
 
-    def op(pc, mat, ncell, cells, cell_dofmap):
-        funptr(0, ncell, cells, mat.handle,
-               cell_dofmap, cell_dofmap, *op_args)
-        mat.assemble()
+    # The PC calls the kernel directly, so keep alive everything it
+    # points into.
+    kernel = ctypes.cast(funptr, ctypes.c_void_p).value
     patch.setPatchDMPlex(mesh._plex)
     patch.setPatchDefaultSF(V.dm.getDefaultSF())
     patch.setPatchCellNumbering(mesh._cell_numbering)
     patch.setPatchDiscretisationInfo(V.dm.getDefaultSection(),
                                      V.value_size, V.cell_node_list,
                                      bc_nodes)
-    patch.setPatchComputeOperator(op)
+    patch.setPatchComputeOperatorKernel(kernel, op_args,
+                                        keepalive=(funptr, op_coeffs))
+    opts = PETSc.Options(patch.getOptionsPrefix())
+    if V.value_size == 1 and opts.getString("pc_patch_solver_type", "ksp") == "fdm":
+        # Fast diagonalisation looks for tensor product patches, so
+        # needs to know where the nodes are.  Selecting it any other
+        # way needs a call to setPatchDofCoordinates, or setup fails.
+        from firedrake import Function, SpatialCoordinate, VectorFunctionSpace
+        X = Function(VectorFunctionSpace(mesh, V.ufl_element()))
+        X.interpolate(SpatialCoordinate(mesh))
+        patch.setPatchDofCoordinates(X.dat.data_ro_with_halos)
     return patch